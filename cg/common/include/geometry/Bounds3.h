@@ -33,7 +33,7 @@
 #ifndef __Bounds3_h
 #define __Bounds3_h
 
-#include "geometry/Ray.h"
+#include "geometry/RayPrecomputed.h"
 
 namespace cg
 { // begin namespace cg
@@ -250,6 +250,27 @@ public:
     return true;
   }
 
+  /// Clips [ray.tMin, ray.tMax] against the slabs of the box, picking
+  /// the near and far plane of each one by the direction signs, with
+  /// no divisions. The box is hit if tMin <= tMax.
+  HOST DEVICE
+  bool intersect(const RayPrecomputed& ray, float& tMin, float& tMax) const
+  {
+    tMin = ray.tMin;
+    tMax = ray.tMax;
+    for (int i = 0; i < 3; i++)
+    {
+      auto pNear = ray.sign[i] ? _p2[i] : _p1[i];
+      auto pFar = ray.sign[i] ? _p1[i] : _p2[i];
+      auto t1 = (pNear - ray.origin[i]) * ray.inverse[i];
+      auto t2 = (pFar - ray.origin[i]) * ray.inverse[i];
+
+      tMin = t1 > tMin ? t1 : tMin;
+      tMax = t2 < tMax ? t2 : tMax;
+    }
+    return tMin <= tMax;
+  }
+
   void print(const char* s, FILE* f = stdout) const
   {
     fprintf(f, "%s\n", s);
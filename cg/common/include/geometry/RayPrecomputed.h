@@ -0,0 +1,93 @@
+//[]---------------------------------------------------------------[]
+//|                                                                 |
+//| Copyright (C) 2014, 2019 Orthrus Group.                         |
+//|                                                                 |
+//| This software is provided 'as-is', without any express or       |
+//| implied warranty. In no event will the authors be held liable   |
+//| for any damages arising from the use of this software.          |
+//|                                                                 |
+//| Permission is granted to anyone to use this software for any    |
+//| purpose, including commercial applications, and to alter it and |
+//| redistribute it freely, subject to the following restrictions:  |
+//|                                                                 |
+//| 1. The origin of this software must not be misrepresented; you  |
+//| must not claim that you wrote the original software. If you use |
+//| this software in a product, an acknowledgment in the product    |
+//| documentation would be appreciated but is not required.         |
+//|                                                                 |
+//| 2. Altered source versions must be plainly marked as such, and  |
+//| must not be misrepresented as being the original software.      |
+//|                                                                 |
+//| 3. This notice may not be removed or altered from any source    |
+//| distribution.                                                   |
+//|                                                                 |
+//[]---------------------------------------------------------------[]
+//
+//  OVERVIEW: RayPrecomputed.h
+//  ========
+//  Class definition for ray with precomputed slab test data.
+//
+// Author: Paulo Pagliosa (and your name)
+// Last revision: 18/11/2019
+
+#ifndef __RayPrecomputed_h
+#define __RayPrecomputed_h
+
+#include "geometry/Ray.h"
+#include <cmath>
+#include <limits>
+
+namespace cg
+{ // begin namespace cg
+
+
+//////////////////////////////////////////////////////////
+//
+// RayPrecomputed: ray with precomputed slab test data class
+// ==============
+// Built once per ray (in the space of the boxes it is tested
+// against), so that a ray/box slab test needs neither divisions nor
+// branches: the near plane of each slab is picked by the sign of the
+// direction component.
+//
+struct RayPrecomputed
+{
+  vec3f origin;
+  vec3f inverse; // of the direction; huge but finite for null components
+  int sign[3]; // 1 if the direction component is negative, i.e., the
+               // index of the near plane of the slab (0: min, 1: max)
+  float tMin;
+  float tMax;
+
+  HOST DEVICE
+  explicit RayPrecomputed(const Ray& ray):
+    RayPrecomputed{ray, ray.tMin, ray.tMax}
+  {
+    // do nothing
+  }
+
+  HOST DEVICE
+  RayPrecomputed(const Ray& ray, float tMin, float tMax):
+    origin{ray.origin},
+    tMin{tMin},
+    tMax{tMax}
+  {
+    for (int i = 0; i < 3; ++i)
+    {
+      auto inv = math::inverse(ray.direction[i]);
+
+      // A huge finite inverse of a null component keeps (p - o) * inverse
+      // free of NaNs when the origin lies on a slab plane
+      if (!std::isfinite(inv))
+        inv = std::copysign(std::numeric_limits<float>::max(),
+          ray.direction[i]);
+      inverse[i] = inv;
+      sign[i] = inv < 0;
+    }
+  }
+
+}; // RayPrecomputed
+
+} // end namespace cg
+
+#endif // __RayPrecomputed_h
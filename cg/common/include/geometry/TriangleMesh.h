@@ -174,6 +174,18 @@ public:
   void computeNormals();
   void TRS(const mat4f& trs);
 
+  /// Returns a counter incremented whenever the vertices change.
+  uint32_t version() const
+  {
+    return _version;
+  }
+
+  /// Marks the vertices as changed after writing them in place.
+  void touch()
+  {
+    ++_version;
+  }
+
   const Data& data() const
   {
     return _data;
@@ -193,6 +205,7 @@ public:
 
 private:
   Data _data;
+  uint32_t _version{};
 
 }; // TriangleMesh
 
@@ -91,6 +91,8 @@ createTexture(int w, int h)
 inline void
 setTextureData(int x, int y, int w, int h, const Pixel* data)
 {
+  // pixel rows are tightly packed
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
   glTexSubImage2D(GL_TEXTURE_2D,
     0,
     x,
@@ -195,6 +197,7 @@ GLImage::bind() const
 void
 GLImage::setSubImage(int x, int y, int w, int h, const Pixel* data)
 {
+  bind();
   setTextureData(x, y, w, h, data);
 }
 
@@ -101,6 +101,7 @@ TriangleMesh::TRS(const mat4f& trs)
 
   for (int i = 0; i < nv; ++i)
     _data.vertices[i] = trs.transform3x4(_data.vertices[i]);
+  touch();
   if (_data.vertexNormals == nullptr)
     return;
 
@@ -31,6 +31,25 @@
 // Last revision: 18/11/2019
 
 #include "BVH.h"
+#include "MappedFile.h"
+#include "ThreadPool.h"
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <limits>
+#include <memory>
+
+#if defined(__AVX2__)
+#define BVH_SIMD_AVX2
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || \
+  (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define BVH_SIMD_SSE
+#include <emmintrin.h>
+#endif
 
 namespace cg
 { // begin namespace cg
@@ -53,278 +72,3171 @@ struct BVH::TriangleInfo
 
 }; // BVH::TriangleInfo
 
-struct BVH::Node
+// Output of a (parallel) build task. Leaves index triangles in tris,
+// not yet padded to group boundaries. A node with pad set stands for
+// the subtree built by another task, children[first]
+struct BVH::Subtree
 {
-  Bounds3f bounds;
-  Node* children[2];
-  int first;
-  int count;
+  NodeArray nodes;
+  TriangleIndexArray tris;
+  std::vector<std::unique_ptr<Subtree>> children;
+  int spatialSplitCount{};
+
+}; // BVH::Subtree
+
+struct BVH::BuildState
+{
+  TriangleInfoArray& triangleInfo;
+  const uint64_t* mortonCodes; // sorted codes of the LBVH builder
+  ThreadPool* pool;
+  float rootArea; // SBVH only
+  // Subtree tasks submitted and not finished yet. The build waits for
+  // them by this count, not by the pool's, before flattening the tree
+  int subtreeTasks;
+  std::mutex mutex;
+  std::condition_variable done;
+
+  // Builds a subtree on the pool; worker is the one submitting it, or
+  // -1 from the building thread
+  template <typename F>
+  void submit(int worker, const F& f)
+  {
+    {
+      std::lock_guard<std::mutex> lock{mutex};
+      ++subtreeTasks;
+    }
+
+    auto task = [this, f](int w)
+    {
+      f(w);
+
+      std::lock_guard<std::mutex> lock{mutex};
+
+      if (--subtreeTasks == 0)
+        done.notify_all();
+    };
+
+    if (worker < 0)
+      pool->submit(task);
+    else
+      pool->submit(worker, task);
+  }
+
+  void wait()
+  {
+    std::unique_lock<std::mutex> lock{mutex};
+    done.wait(lock, [this]() { return subtreeTasks == 0; });
+  }
+
+}; // BVH::BuildState
+
+inline void
+BVH::makeLeaf(Subtree& s,
+  TriangleInfoArray& triangleInfo,
+  int start,
+  int end)
+{
+  auto& node = s.nodes.emplace_back();
 
-  Node(const Bounds3f& b, int first, int count):
-    bounds{b},
-    first{first},
-    count{count}
+  node.first = int(s.tris.size());
+  node.count = uint16_t(end - start);
+  node.axis = node.pad = 0;
+  for (int i = start; i < end; ++i)
   {
-    children[0] = children[1] = nullptr;
+    node.bounds.inflate(triangleInfo[i].bounds);
+    s.tris.push_back(triangleInfo[i].index);
   }
+}
+
+// Number of triangle tests the SAH charges for n leaf triangles
+inline int
+leafTests(int n)
+{
+#ifdef BVH_SCALAR_LEAVES
+  return n;
+#else
+  return (n + BVH_GROUP_SIZE - 1) / BVH_GROUP_SIZE;
+#endif // BVH_SCALAR_LEAVES
+}
+
+int
+BVH::splitSAH(TriangleInfoArray& triangleInfo,
+  int start,
+  int end,
+  const Bounds3f& bounds,
+  const Bounds3f& centroidBounds,
+  int dim) const
+{
+  struct Bin
+  {
+    Bounds3f bounds;
+    int count{};
+  };
+
+  const auto nb = std::min(std::max(_params.numberOfBins, 2), BVH_MAX_BINS);
+  const auto cMin = centroidBounds.min()[dim];
+  const auto scale = nb / (centroidBounds.max()[dim] - cMin);
+  auto binIndex = [=](const TriangleInfo& t)
+  {
+    return std::min(int((t.centroid[dim] - cMin) * scale), nb - 1);
+  };
+  Bin bins[BVH_MAX_BINS];
 
-  Node(Node* c0, Node* c1):
-    count{0}
+  for (int i = start; i < end; ++i)
   {
-    bounds.inflate(c0->bounds);
-    bounds.inflate(c1->bounds);
-    children[0] = c0;
-    children[1] = c1;
+    auto& bin = bins[binIndex(triangleInfo[i])];
+
+    bin.bounds.inflate(triangleInfo[i].bounds);
+    bin.count++;
   }
 
-  ~Node()
+  // Sweep from the right to accumulate the areas of the right sides,
+  // then from the left to evaluate the cost of each split plane
+  float rightArea[BVH_MAX_BINS];
+  Bounds3f b;
+
+  for (int i = nb - 1, count = 0; i > 0; --i)
   {
-    delete children[0];
-    delete children[1];
+    if (bins[i].count > 0)
+    {
+      b.inflate(bins[i].bounds);
+      count += bins[i].count;
+    }
+    rightArea[i] = leafTests(count) * b.area();
   }
+  b.setEmpty();
+
+  auto minCost = math::Limits<float>::inf();
+  auto minBin = -1;
 
-  bool isLeaf() const
+  for (int i = 0, count = 0; i < nb - 1; ++i)
   {
-    return children[0] == nullptr;
+    if (bins[i].count > 0)
+    {
+      b.inflate(bins[i].bounds);
+      count += bins[i].count;
+    }
+    if (count == 0 || count == end - start)
+      continue;
+
+    auto cost = leafTests(count) * b.area() + rightArea[i + 1];
+
+    if (cost < minCost)
+    {
+      minCost = cost;
+      minBin = i;
+    }
   }
 
-  static void iterate(const Node* node, BVHNodeFunction f);
+  const auto n = end - start;
 
-}; // BVH::Node
+  if (minBin < 0)
+    return -1;
+  minCost = _params.traversalCost +
+    _params.intersectionCost * minCost / bounds.area();
+  if (n <= _params.maxTrisPerNode &&
+    minCost >= _params.intersectionCost * leafTests(n))
+    return -1;
 
-void
-BVH::Node::iterate(const Node* node, BVHNodeFunction f)
-{
-  if (node == nullptr)
-    return;
+  auto mid = std::partition(&triangleInfo[start],
+    &triangleInfo[end - 1] + 1,
+    [=](const TriangleInfo& t)
+    {
+      return binIndex(t) <= minBin;
+    });
+  return int(mid - &triangleInfo[0]);
+}
 
-  auto isLeaf = node->isLeaf();
+// Splits a range of sorted Morton codes where the highest bit in
+// which they differ flips; that bit also tells the split axis
+inline int
+splitMorton(const uint64_t* codes, int start, int end, int& dim)
+{
+  auto x = codes[start] ^ codes[end - 1];
 
-  f({node->bounds, isLeaf, node->first, node->count});
-  if (!isLeaf)
+  if (x == 0)
   {
-    iterate(node->children[0], f);
-    iterate(node->children[1], f);
+    // Same cell: split at the middle
+    dim = 0;
+    return (start + end) / 2;
   }
+
+  int bit = 63;
+
+  while ((x >> bit) == 0)
+    --bit;
+  dim = 2 - bit % 3;
+
+  const auto mask = uint64_t(1) << bit;
+
+  return int(std::partition_point(codes + start,
+    codes + end,
+    [mask](uint64_t code)
+    {
+      return (code & mask) == 0;
+    }) - codes);
 }
 
-inline BVH::Node*
-BVH::makeLeaf(TriangleInfoArray& triangleInfo,
+void
+BVH::makeNode(Subtree& s,
+  BuildState& state,
   int start,
   int end,
-  TriangleIndexArray& orderedTris)
+  int depth,
+  int worker)
 {
+  auto& triangleInfo = state.triangleInfo;
+  const auto n = end - start;
+  const auto sah = _params.splitMethod == BVHSplitMethod::SAH;
+
+  if (n == 1 || (!sah && n <= _params.maxTrisPerNode))
+    return makeLeaf(s, triangleInfo, start, end);
+  // The traversal stack holds at most one node per level
+  if (depth == BVH_MAX_DEPTH - 1 && n <= BVH_MAX_LEAF_SIZE)
+    return makeLeaf(s, triangleInfo, start, end);
+
   Bounds3f bounds;
-  auto first = int(orderedTris.size());
+  int dim;
+  int mid;
 
-  for (int i = start; i < end; ++i)
+  // LBVH nodes are split by their codes alone; their bounds are only
+  // computed when the tree is complete (see updateInteriorBounds())
+  if (state.mortonCodes != nullptr)
+    mid = splitMorton(state.mortonCodes, start, end, dim);
+  else
+  {
+    Bounds3f centroidBounds;
+
+    for (int i = start; i < end; ++i)
+    {
+      bounds.inflate(triangleInfo[i].bounds);
+      centroidBounds.inflate(triangleInfo[i].centroid);
+    }
+    dim = maxDim(centroidBounds);
+    if (centroidBounds.max()[dim] == centroidBounds.min()[dim])
+    {
+      if (n <= BVH_MAX_LEAF_SIZE)
+        return makeLeaf(s, triangleInfo, start, end);
+      // Too many coincident centroids for a single leaf
+      mid = (start + end) / 2;
+    }
+    // Partition tris into two sets and build children
+    else if (sah)
+    {
+      mid = splitSAH(triangleInfo, start, end, bounds, centroidBounds, dim);
+      if (mid < 0)
+        return makeLeaf(s, triangleInfo, start, end);
+    }
+    else
+      mid = medianSplit(triangleInfo.data(),
+        start,
+        end,
+        dim,
+        [](const TriangleInfo& t) { return t.centroid; });
+  }
+
+  // Nodes are stored in depth-first order: the first child follows
+  // its parent and the second one is referenced by index
+  auto index = int(s.nodes.size());
+
+  s.nodes.emplace_back();
+
+  Subtree* task{};
+  auto taskIndex = int(s.children.size());
+  auto pool = state.pool;
+
+  // A large enough second child is built by a task while this thread
+  // goes on with the first one. The task only touches its own subtree
+  // and its own range of triangleInfo, so the tree does not depend on
+  // the number of threads
+  if (pool != nullptr && end - mid >= BVH_PARALLEL_MIN_TRIS)
+  {
+    task = s.children.emplace_back(new Subtree).get();
+
+    auto f = [=, &state](int worker)
+    {
+      makeNode(*task, state, mid, end, depth + 1, worker);
+    };
+
+    state.submit(worker, f);
+  }
+  makeNode(s, state, start, mid, depth + 1, worker);
+
+  auto secondChild = int(s.nodes.size());
+
+  if (task == nullptr)
+    makeNode(s, state, mid, end, depth + 1, worker);
+  else
   {
-    bounds.inflate(triangleInfo[i].bounds);
-    orderedTris.push_back(_triangles[triangleInfo[i].index]);
+    auto& node = s.nodes.emplace_back();
+
+    node.first = taskIndex;
+    node.count = 0;
+    node.axis = 0;
+    node.pad = 1;
   }
-  return new Node{bounds, first, end - start};
+
+  auto& node = s.nodes[index];
+
+  node.bounds = bounds;
+  node.secondChild = secondChild;
+  node.count = 0;
+  node.axis = uint8_t(dim);
+  node.pad = 0;
 }
 
-inline auto
-maxDim(const Bounds3f& b)
+inline bool
+isEmpty(const Bounds3f& b)
 {
-  auto s = b.size();
-  return s.x > s.y && s.x > s.z ? 0 : (s.y > s.z ? 1 : 2);
+  return b.min().x > b.max().x;
 }
 
-BVH::Node*
-BVH::makeNode(TriangleInfoArray& triangleInfo,
-  int start,
-  int end,
-  TriangleIndexArray& orderedTris)
+inline bool
+overlap(const Bounds3f& a, const Bounds3f& b)
 {
-  ++_nodeCount;
-  if (end - start <= _maxTrisPerNode)
-    return makeLeaf(triangleInfo, start, end, orderedTris);
-
-  Bounds3f centroidBounds;
+  for (int i = 0; i < 3; ++i)
+    if (a.min()[i] > b.max()[i] || b.min()[i] > a.max()[i])
+      return false;
+  return true;
+}
 
-  for (int i = start; i < end; ++i)
-    centroidBounds.inflate(triangleInfo[i].centroid);
+// Bounds of the intersection of a and b, which must overlap. Rounding
+// errors that would invert the result are clamped away
+inline Bounds3f
+clip(const Bounds3f& a, const Bounds3f& b)
+{
+  vec3f p1, p2;
 
-  auto dim = maxDim(centroidBounds);
+  for (int i = 0; i < 3; ++i)
+  {
+    p1[i] = std::max(a.min()[i], b.min()[i]);
+    p2[i] = std::max(std::min(a.max()[i], b.max()[i]), p1[i]);
+  }
+  return {p1, p2};
+}
 
-  if (centroidBounds.max()[dim] == centroidBounds.min()[dim])
-    return makeLeaf(triangleInfo, start, end, orderedTris);
+void
+BVH::splitReference(const TriangleInfo& ref,
+  int dim,
+  float position,
+  TriangleInfo& left,
+  TriangleInfo& right) const
+{
+  const auto& data = _mesh->data();
+  auto v = data.triangles[ref.index].v;
+  Bounds3f l;
+  Bounds3f r;
 
-  // Partition tris into two sets and build children
-  auto mid = (start + end) / 2;
+  // Vertices go to their side of the plane and the points where the
+  // edges cross it go to both sides
+  for (int i = 0; i < 3; ++i)
+  {
+    const auto& p = data.vertices[v[i]];
+    const auto& q = data.vertices[v[(i + 1) % 3]];
+    auto pd = p[dim];
+    auto qd = q[dim];
 
-  std::nth_element(&triangleInfo[start],
-    &triangleInfo[mid],
-    &triangleInfo[end - 1] + 1,
-    [dim] (const TriangleInfo& a, const TriangleInfo& b)
+    if (pd <= position)
+      l.inflate(p);
+    if (pd >= position)
+      r.inflate(p);
+    if ((pd < position && qd > position) || (pd > position && qd < position))
     {
-      return a.centroid[dim] < b.centroid[dim];
-    });
-  return new Node{makeNode(triangleInfo, start, mid, orderedTris),
-    makeNode(triangleInfo, mid, end, orderedTris)};
+      auto t = std::min(std::max((position - pd) / (qd - pd), 0.0f), 1.0f);
+      auto x = p + (q - p) * t;
+
+      x[dim] = position;
+      l.inflate(x);
+      r.inflate(x);
+    }
+  }
+  // The parts are clipped to the reference, which may already be a
+  // part of the triangle
+  left = {ref.index, clip(l, ref.bounds)};
+  right = {ref.index, clip(r, ref.bounds)};
 }
 
-BVH::BVH(TriangleMesh& mesh, int maxTrisPerNode):
-  _mesh{&mesh},
-  _maxTrisPerNode{maxTrisPerNode}
+int
+BVH::maxReferenceCount() const
 {
-  const auto& data = mesh.data();
-  int nt{data.numberOfTriangles};
+  auto nt = _mesh->data().numberOfTriangles;
 
-  if (nt == 0)
-    return;
-  _triangles.resize(nt);
+  if (_params.splitMethod != BVHSplitMethod::SBVH)
+    return nt;
+  return nt + int(_params.maxDuplication * nt);
+}
 
-  TriangleInfoArray triangleInfo(nt);
+// Spatial split BVH (Stich et al., 2009). A node is split either by
+// the best binned SAH object split or by the best binned spatial
+// split, which clips the triangles crossing the split plane and
+// references them on both sides. Spatial splits are tried only where
+// the children of the object split overlap by more than
+// spatialSplitAlpha times the root area. The node may add at most
+// budget references; what is left of it is shared by the children in
+// proportion to their references, so that the tree does not depend
+// on the number of threads
+void
+BVH::makeSpatialNode(Subtree& s,
+  BuildState& state,
+  TriangleInfoArray& refs,
+  int budget,
+  int depth,
+  int worker)
+{
+  const auto n = int(refs.size());
+
+  if (n == 1)
+    return makeLeaf(s, refs, 0, n);
+  if (depth == BVH_MAX_DEPTH - 1 && n <= BVH_MAX_LEAF_SIZE)
+    return makeLeaf(s, refs, 0, n);
+
+  struct Bin
+  {
+    Bounds3f bounds;
+    int count{}; // object bins: references; spatial bins: entries
+    int exitCount{};
+  };
+
+  struct Split
+  {
+    float cost{math::Limits<float>::inf()};
+    int dim{-1};
+    int bin;
+    Bounds3f left;
+    Bounds3f right;
+    int leftCount;
+    int rightCount;
+  };
+
+  const auto nb = std::min(std::max(_params.numberOfBins, 2), BVH_MAX_BINS);
+  Bounds3f bounds;
+  Bounds3f centroidBounds;
 
-  for (int i = 0; i < nt; ++i)
+  for (const auto& ref : refs)
   {
-    _triangles[i] = i;
+    bounds.inflate(ref.bounds);
+    centroidBounds.inflate(ref.centroid);
+  }
 
-    auto t = data.triangles + i;
+  // Evaluates the n - 1 planes between the bins along dim
+  auto sweep = [nb](const Bin* bins, int dim, Split& split)
+  {
+    Bounds3f rightBounds[BVH_MAX_BINS];
+    int rightCount[BVH_MAX_BINS];
     Bounds3f b;
 
-    b.inflate(data.vertices[t->v[0]]);
-    b.inflate(data.vertices[t->v[1]]);
-    b.inflate(data.vertices[t->v[2]]);
-    triangleInfo[i] = {i, b};
+    for (int i = nb - 1, count = 0; i > 0; --i)
+    {
+      if (!isEmpty(bins[i].bounds))
+        b.inflate(bins[i].bounds);
+      count += bins[i].exitCount;
+      rightBounds[i] = b;
+      rightCount[i] = count;
+    }
+    b.setEmpty();
+    for (int i = 0, count = 0; i < nb - 1; ++i)
+    {
+      if (!isEmpty(bins[i].bounds))
+        b.inflate(bins[i].bounds);
+      count += bins[i].count;
+      if (count == 0 || rightCount[i + 1] == 0)
+        continue;
+
+      auto cost = leafTests(count) * b.area() +
+        leafTests(rightCount[i + 1]) * rightBounds[i + 1].area();
+
+      if (cost < split.cost)
+        split = {cost, dim, i, b, rightBounds[i + 1], count, rightCount[i + 1]};
+    }
+  };
+
+  // Object splits along every axis
+  Split object;
+
+  for (int dim = 0; dim < 3; ++dim)
+  {
+    const auto cMin = centroidBounds.min()[dim];
+    const auto extent = centroidBounds.max()[dim] - cMin;
+
+    if (!(extent > 0))
+      continue;
+
+    const auto scale = nb / extent;
+    Bin bins[BVH_MAX_BINS];
+
+    for (const auto& ref : refs)
+    {
+      auto& bin = bins[std::min(int((ref.centroid[dim] - cMin) * scale), nb - 1)];
+
+      bin.bounds.inflate(ref.bounds);
+      bin.count++;
+      bin.exitCount++;
+    }
+    sweep(bins, dim, object);
   }
 
-  TriangleIndexArray orderedTris;
-  
-  orderedTris.reserve(nt);
-  _root = makeNode(triangleInfo, 0, nt, orderedTris);
-  _triangles.swap(orderedTris);
-#ifdef _DEBUG
-  if (true)
+  // Spatial splits along every axis, if the object split leaves the
+  // children overlapping too much
+  Split spatial;
+
+  if (budget > 0 && object.dim >= 0 &&
+    overlap(object.left, object.right) &&
+    clip(object.left, object.right).area() >
+    _params.spatialSplitAlpha * state.rootArea)
+    for (int dim = 0; dim < 3; ++dim)
+    {
+      const auto lo = bounds.min()[dim];
+      const auto extent = bounds.max()[dim] - lo;
+
+      if (!(extent > 0))
+        continue;
+
+      const auto width = extent / nb;
+      auto binIndex = [=](float x)
+      {
+        return std::min(std::max(int((x - lo) / width), 0), nb - 1);
+      };
+      Bin bins[BVH_MAX_BINS];
+
+      for (const auto& ref : refs)
+      {
+        auto first = binIndex(ref.bounds.min()[dim]);
+        auto last = binIndex(ref.bounds.max()[dim]);
+        auto part = ref;
+
+        // The parts of the triangle are clipped bin by bin
+        for (int i = first; i < last; ++i)
+        {
+          TriangleInfo l;
+
+          splitReference(part, dim, lo + (i + 1) * width, l, part);
+          bins[i].bounds.inflate(l.bounds);
+        }
+        bins[last].bounds.inflate(part.bounds);
+        bins[first].count++;
+        bins[last].exitCount++;
+      }
+      sweep(bins, dim, spatial);
+    }
+  if (spatial.dim >= 0 &&
+    (spatial.cost >= object.cost ||
+    spatial.leftCount + spatial.rightCount - n > budget))
+    spatial.dim = -1;
+
+  const auto ct = _params.traversalCost;
+  const auto ci = _params.intersectionCost;
+  const auto& best = spatial.dim >= 0 ? spatial : object;
+
+  if (best.dim < 0)
   {
-    mesh.bounds().print("Mesh bounds:");
-    printf("Mesh triangles: %d\n", nt);
-    bounds().print("BVH bounds:");
-    printf("BVH nodes: %d\n", _nodeCount);
-    iterate([this] (const BVHNodeInfo& node)
+    if (n <= BVH_MAX_LEAF_SIZE)
+      return makeLeaf(s, refs, 0, n);
+  }
+  else if (n <= _params.maxTrisPerNode &&
+    ct + ci * best.cost / bounds.area() >= ci * leafTests(n))
+    return makeLeaf(s, refs, 0, n);
+
+  TriangleInfoArray left;
+  TriangleInfoArray right;
+
+  if (spatial.dim >= 0)
+  {
+    const auto dim = spatial.dim;
+    const auto lo = bounds.min()[dim];
+    const auto position = lo + (spatial.bin + 1) * (bounds.size()[dim] / nb);
+    auto lb = spatial.left;
+    auto rb = spatial.right;
+    const auto nl = spatial.leftCount;
+    const auto nr = spatial.rightCount;
+    auto added = 0;
+
+    for (const auto& ref : refs)
+      if (ref.bounds.max()[dim] <= position)
+        left.push_back(ref);
+      else if (ref.bounds.min()[dim] >= position)
+        right.push_back(ref);
+      else
+      {
+        TriangleInfo l;
+        TriangleInfo r;
+
+        splitReference(ref, dim, position, l, r);
+
+        // A reference is moved to one side instead of split, if that
+        // is cheaper or the budget is exhausted (unsplitting)
+        Bounds3f lr{lb};
+        Bounds3f rr{rb};
+
+        lr.inflate(ref.bounds);
+        rr.inflate(ref.bounds);
+
+        auto splitCost = leafTests(nl) * lb.area() + leafTests(nr) * rb.area();
+        auto leftCost = leafTests(nl) * lr.area() + leafTests(nr - 1) * rb.area();
+        auto rightCost = leafTests(nl - 1) * lb.area() + leafTests(nr) * rr.area();
+
+        if (added < budget && splitCost < leftCost && splitCost < rightCost)
+        {
+          left.push_back(l);
+          right.push_back(r);
+          ++added;
+        }
+        else if (leftCost <= rightCost)
+        {
+          left.push_back(ref);
+          lb = lr;
+        }
+        else
+        {
+          right.push_back(ref);
+          rb = rr;
+        }
+      }
+    if (left.empty() || right.empty())
     {
-      if (!node.isLeaf)
-        return;
-      node.bounds.print("Leaf bounds:");
-      printf("Leaf triangles: %d\n", node.numberOfTriangles);
-      //for (int i = 0; i < node.numberOfTriangles; ++i)
-        //printf("%d ", _triangles[node.firstTriangleIndex + i]);
-      //putchar('\n');
-    });
-    putchar('\n');
+      left.clear();
+      right.clear();
+    }
+    else
+      s.spatialSplitCount++;
   }
-#endif // _DEBUG
+  if (left.empty())
+  {
+    if (object.dim >= 0)
+    {
+      const auto dim = object.dim;
+      const auto cMin = centroidBounds.min()[dim];
+      const auto scale = nb / (centroidBounds.max()[dim] - cMin);
+
+      for (const auto& ref : refs)
+        if (std::min(int((ref.centroid[dim] - cMin) * scale), nb - 1) <=
+          object.bin)
+          left.push_back(ref);
+        else
+          right.push_back(ref);
+    }
+    else
+    {
+      // Too many coincident centroids for a single leaf
+      left.assign(refs.begin(), refs.begin() + n / 2);
+      right.assign(refs.begin() + n / 2, refs.end());
+    }
+  }
+
+  const auto dim = spatial.dim >= 0 ? spatial.dim : std::max(object.dim, 0);
+
+  // The references of this node are no longer needed
+  budget -= int(left.size() + right.size()) - n;
+  TriangleInfoArray{}.swap(refs);
+
+  auto leftBudget = int(int64_t(budget) * int64_t(left.size()) /
+    int64_t(left.size() + right.size()));
+  auto rightBudget = budget - leftBudget;
+
+  // See makeNode()
+  auto index = int(s.nodes.size());
+
+  s.nodes.emplace_back();
+
+  Subtree* task{};
+  auto taskIndex = int(s.children.size());
+  auto pool = state.pool;
+
+  if (pool != nullptr && right.size() >= BVH_PARALLEL_MIN_TRIS)
+  {
+    task = s.children.emplace_back(new Subtree).get();
+
+    auto taskRefs = std::make_shared<TriangleInfoArray>(std::move(right));
+    auto f = [=, &state](int worker)
+    {
+      makeSpatialNode(*task,
+        state,
+        *taskRefs,
+        rightBudget,
+        depth + 1,
+        worker);
+    };
+
+    state.submit(worker, f);
+  }
+  makeSpatialNode(s, state, left, leftBudget, depth + 1, worker);
+
+  auto secondChild = int(s.nodes.size());
+
+  if (task == nullptr)
+    makeSpatialNode(s, state, right, rightBudget, depth + 1, worker);
+  else
+  {
+    auto& node = s.nodes.emplace_back();
+
+    node.first = taskIndex;
+    node.count = 0;
+    node.axis = 0;
+    node.pad = 1;
+  }
+
+  auto& node = s.nodes[index];
+
+  node.bounds = bounds;
+  node.secondChild = secondChild;
+  node.count = 0;
+  node.axis = uint8_t(dim);
+  node.pad = 0;
 }
 
-BVH::~BVH()
+void
+BVH::flatten(const Subtree& s)
 {
-  delete _root;
+  const auto n = int(s.nodes.size());
+  std::vector<int> index(n);
+
+  _spatialSplitStats.splitCount += s.spatialSplitCount;
+
+  // Subtrees built by tasks are spliced in depth-first order, and the
+  // leaves are padded as they are appended, so the arrays are the ones
+  // a serial build would output
+  for (int i = 0; i < n; ++i)
+  {
+    const auto& node = s.nodes[i];
+
+    index[i] = int(_nodes.size());
+    if (node.pad != 0)
+    {
+      flatten(*s.children[node.first]);
+      continue;
+    }
+    _nodes.push_back(node);
+    if (!node.isLeaf())
+      continue;
+    while (_triangles.size() % BVH_GROUP_SIZE != 0)
+      _triangles.push_back(-1);
+    _nodes.back().first = int(_triangles.size());
+    _triangles.insert(_triangles.end(),
+      s.tris.begin() + node.first,
+      s.tris.begin() + node.first + node.count);
+  }
+  for (int i = 0; i < n; ++i)
+  {
+    const auto& node = s.nodes[i];
+
+    if (node.pad == 0 && !node.isLeaf())
+      _nodes[index[i]].secondChild = index[node.secondChild];
+  }
 }
 
-Bounds3f
-BVH::bounds() const
+float
+BVH::computeSAHCost() const
 {
-  return _root == nullptr ? Bounds3f{} : _root->bounds;
+  auto area = bounds().area();
+
+  if (!(area > 0))
+    return 0;
+
+  auto cost = 0.0f;
+  auto ct = _params.traversalCost;
+  auto ci = _params.intersectionCost;
+
+  iterate([&cost, ct, ci](const BVHNodeInfo& node)
+  {
+    auto a = node.bounds.area();
+    cost += node.isLeaf ? ci * node.numberOfTriangles * a : ct * a;
+  });
+  return cost / area;
 }
 
+// Runs f(begin, end) over chunks of [0, n) on the pool, if any
+template <typename F>
 void
-BVH::iterate(BVHNodeFunction f) const
+parallelFor(ThreadPool* pool, int n, const F& f, int chunk = BVH_PARALLEL_MIN_TRIS)
 {
-  Node::iterate(_root, f);
+  if (pool == nullptr || n <= chunk)
+    return f(0, n);
+  for (int i = 0; i < n; i += chunk)
+    pool->submit([i, n, chunk, &f](int)
+    {
+      f(i, std::min(i + chunk, n));
+    });
+  pool->wait();
 }
 
-bool
-BVH::intersect(const Ray& ray, Intersection& hit, float d) const
+void
+BVH::buildTriangleGroups(ThreadPool* pool)
 {
-  // TODO
-	std::stack<Node*> nodes;
-
-	bool ret = false;
-	nodes.push(_root);
-
-	// 
-	while (!nodes.empty())
-	{
-		// get the top element and update the stack content 
-		auto top = nodes.top();
-		nodes.pop();
-
-		float tMin, tMax	;
-
-		if (!top->bounds.intersect(ray, tMin, tMax))
-			continue;
-		else
-		{
-			if (!top->isLeaf())
-			{
-				auto children = top->children;
-				nodes.push(children[0]);
-				nodes.push(children[1]);
-			}
-			// primitive intersect starts here
-			else
-			{
-				
-				// TODO: mesh intersection
-				auto data = _mesh->data();
-				auto o = ray.origin;
-				auto D = ray.direction;
-
-				for (int i = top->first; i < top->first + top->count; i++) //right
-				{
-					auto ti = data.triangles[_triangles[i]];
-					auto p0 = data.vertices[ti.v[0]];
-					auto p1 = data.vertices[ti.v[1]];
-					auto p2 = data.vertices[ti.v[2]];
-
-					auto e1 = p1 - p0;
-					auto e2 = p2 - p0;
-					auto s1 = D.cross(e2);
-
-					auto s1e1 = s1.dot(e1);
-					if (math::isZero(abs(s1e1)))
-						continue;
-					auto invd = 1 / s1e1;
-
-					auto s = o - p0;
-					auto s2 = s.cross(e1);
-					auto t = s2.dot(e2) * invd;
-					if (!isgreaterequal(t, 0.0f))
-						continue;
-
-					auto dist = t *d;
-					if (dist > hit.distance)
-						continue;
-
-					auto b1 = s1.dot(s) * invd;
-					if (!isgreaterequal(b1, 0.0f))
-						continue;
-
-					auto b2 = s2.dot(D) * invd;
-					if (!isgreaterequal(b2, 0.0f))
-						continue;
-
-					auto b1b2 = b1 + b2;
-					if (isgreater(b1b2, 1))
-						continue;
-
-
-					//hit.object = this;
-					hit.triangleIndex = _triangles[i];
-					hit.distance = dist;
-					hit.p = vec3f{ 1 - b1b2, b1, b2 };
-					ret = true;
-					
-				}
-			}
-		}
-
-	}
+  while (_triangles.size() % BVH_GROUP_SIZE != 0)
+    _triangles.push_back(-1);
+  _groups.assign(_triangles.size() / BVH_GROUP_SIZE, TriangleGroup{});
 
-  return ret;
+  const auto& data = _mesh->data();
+
+  parallelFor(pool, int(_groups.size()), [&](int begin, int end)
+  {
+    for (int i = begin * BVH_GROUP_SIZE; i < end * BVH_GROUP_SIZE; ++i)
+    {
+      auto& g = _groups[i / BVH_GROUP_SIZE];
+      auto k = i % BVH_GROUP_SIZE;
+
+      if ((g.index[k] = _triangles[i]) < 0)
+        continue;
+
+      auto v = data.triangles[_triangles[i]].v;
+      const auto& p0 = data.vertices[v[0]];
+      auto e1 = data.vertices[v[1]] - p0;
+      auto e2 = data.vertices[v[2]] - p0;
+
+      for (int j = 0; j < 3; ++j)
+      {
+        g.p0[j][k] = p0[j];
+        g.e1[j][k] = e1[j];
+        g.e2[j][k] = e2[j];
+      }
+    }
+  });
+}
+
+// Spreads the lower 21 bits of x to every third bit
+inline uint64_t
+expandBits(uint64_t x)
+{
+  x &= 0x1fffff;
+  x = (x | x << 32) & 0x1f00000000ffffull;
+  x = (x | x << 16) & 0x1f0000ff0000ffull;
+  x = (x | x << 8) & 0x100f00f00f00f00full;
+  x = (x | x << 4) & 0x10c30c30c30c30c3ull;
+  x = (x | x << 2) & 0x1249249249249249ull;
+  return x;
+}
+
+void
+BVH::sortByMortonCodes(TriangleInfoArray& triangleInfo,
+  MortonCodeArray& codes,
+  ThreadPool* pool) const
+{
+  const auto n = int(triangleInfo.size());
+  const auto chunk = BVH_PARALLEL_MIN_TRIS;
+  const auto numberOfChunks = (n + chunk - 1) / chunk;
+  std::vector<Bounds3f> chunkBounds(numberOfChunks);
+
+  // Centroid bounds, reduced in chunk order
+  parallelFor(pool, numberOfChunks, [&](int begin, int end)
+  {
+    for (int c = begin; c < end; ++c)
+      for (int i = c * chunk, e = std::min(i + chunk, n); i < e; ++i)
+        chunkBounds[c].inflate(triangleInfo[i].centroid);
+  }, 1);
+
+  Bounds3f centroidBounds;
+
+  for (const auto& b : chunkBounds)
+    if (!b.empty())
+      centroidBounds.inflate(b);
+
+  const auto bitsPerAxis = _params.mortonBits > 30 ? 21 : 10;
+  const auto cells = float(1 << bitsPerAxis);
+  const auto pMin = centroidBounds.min();
+  auto scale = centroidBounds.size();
+
+  for (int i = 0; i < 3; ++i)
+    scale[i] = scale[i] > 0 ? cells / scale[i] : 0;
+
+  MortonCodeArray keys(n);
+  std::vector<int> values(n);
+
+  parallelFor(pool, n, [&](int begin, int end)
+  {
+    for (int i = begin; i < end; ++i)
+    {
+      uint64_t q[3];
+
+      for (int j = 0; j < 3; ++j)
+      {
+        auto c = (triangleInfo[i].centroid[j] - pMin[j]) * scale[j];
+        q[j] = uint64_t(std::min(std::max(c, 0.0f), cells - 1));
+      }
+      keys[i] = expandBits(q[0]) << 2 | expandBits(q[1]) << 1 |
+        expandBits(q[2]);
+      values[i] = i;
+    }
+  });
+
+  // LSD radix sort, 8 bits per pass. Every chunk counts its digits and
+  // scatters its keys to offsets computed in chunk order, so the sort
+  // is stable and independent of the number of threads
+  using Histogram = std::array<int, 256>;
+  std::vector<Histogram> histograms(numberOfChunks);
+  MortonCodeArray tempKeys(n);
+  std::vector<int> tempValues(n);
+
+  for (int shift = 0; shift < 3 * bitsPerAxis; shift += 8)
+  {
+    parallelFor(pool, numberOfChunks, [&](int begin, int end)
+    {
+      for (int c = begin; c < end; ++c)
+      {
+        auto& h = histograms[c];
+
+        h.fill(0);
+        for (int i = c * chunk, e = std::min(i + chunk, n); i < e; ++i)
+          ++h[keys[i] >> shift & 0xff];
+      }
+    }, 1);
+    for (int d = 0, offset = 0; d < 256; ++d)
+      for (auto& h : histograms)
+      {
+        auto count = h[d];
+
+        h[d] = offset;
+        offset += count;
+      }
+    parallelFor(pool, numberOfChunks, [&](int begin, int end)
+    {
+      for (int c = begin; c < end; ++c)
+      {
+        auto& h = histograms[c];
+
+        for (int i = c * chunk, e = std::min(i + chunk, n); i < e; ++i)
+        {
+          auto k = h[keys[i] >> shift & 0xff]++;
+
+          tempKeys[k] = keys[i];
+          tempValues[k] = values[i];
+        }
+      }
+    }, 1);
+    keys.swap(tempKeys);
+    values.swap(tempValues);
+  }
+
+  TriangleInfoArray sorted(n);
+
+  parallelFor(pool, n, [&](int begin, int end)
+  {
+    for (int i = begin; i < end; ++i)
+      sorted[i] = triangleInfo[values[i]];
+  });
+  triangleInfo.swap(sorted);
+  codes.swap(keys);
+}
+
+void
+BVH::updateInteriorBounds()
+{
+  // Children follow their parents in depth-first order
+  for (auto i = int(_nodes.size()) - 1; i >= 0; --i)
+  {
+    auto& node = _nodes[i];
+
+    if (!node.isLeaf())
+    {
+      node.bounds = _nodes[i + 1].bounds;
+      node.bounds.inflate(_nodes[node.secondChild].bounds);
+    }
+  }
+}
+
+// Treelet restructuring (Karras and Aila, 2013). A treelet is grown
+// from a node by repeatedly expanding its largest interior leaf; the
+// topology of least SAH cost over its leaves is found by dynamic
+// programming over the subsets of leaves and replaces the treelet if
+// cheaper. Nodes are visited bottom-up once per pass
+#define BVH_TREELET_SIZE 5
+
+void
+BVH::restructureTreelets(int passes)
+{
+  const auto n = int(_nodes.size());
+
+  if (n < 5 || passes <= 0)
+    return;
+
+  const auto ct = _params.traversalCost;
+  const auto ci = _params.intersectionCost;
+  std::vector<int> left(n, -1);
+  std::vector<int> right(n, -1);
+  std::vector<Bounds3f> bounds(n);
+  std::vector<float> cost(n);
+
+  for (auto i = n - 1; i >= 0; --i)
+  {
+    const auto& node = _nodes[i];
+
+    bounds[i] = node.bounds;
+    if (node.isLeaf())
+      cost[i] = ci * leafTests(node.count) * node.bounds.area();
+    else
+    {
+      left[i] = i + 1;
+      right[i] = node.secondChild;
+      cost[i] = ct * node.bounds.area() + cost[i + 1] +
+        cost[node.secondChild];
+    }
+  }
+
+  constexpr auto m = BVH_TREELET_SIZE;
+  constexpr auto numberOfSets = 1 << m;
+  Bounds3f setBounds[numberOfSets];
+  float setCost[numberOfSets];
+  int setSplit[numberOfSets];
+  std::vector<int> order;
+  std::vector<int> stack;
+
+  order.reserve(n);
+  for (int pass = 0; pass < passes; ++pass)
+  {
+    // Post-order of the current topology
+    order.clear();
+    stack.assign(1, 0);
+    while (!stack.empty())
+    {
+      auto i = stack.back();
+
+      stack.pop_back();
+      order.push_back(i);
+      if (left[i] >= 0)
+      {
+        stack.push_back(left[i]);
+        stack.push_back(right[i]);
+      }
+    }
+    std::reverse(order.begin(), order.end());
+
+    auto changed = false;
+
+    for (auto root : order)
+    {
+      if (left[root] < 0)
+        continue;
+      cost[root] = ct * bounds[root].area() + cost[left[root]] +
+        cost[right[root]];
+
+      int leaves[m]{left[root], right[root]};
+      int interiors[m - 1]{root};
+      int numberOfLeaves = 2;
+      int numberOfInteriors = 1;
+
+      while (numberOfLeaves < m)
+      {
+        auto k = -1;
+        auto maxArea = -1.0f;
+
+        for (int j = 0; j < numberOfLeaves; ++j)
+          if (left[leaves[j]] >= 0 && bounds[leaves[j]].area() > maxArea)
+          {
+            maxArea = bounds[leaves[j]].area();
+            k = j;
+          }
+        if (k < 0)
+          break;
+
+        auto x = leaves[k];
+
+        interiors[numberOfInteriors++] = x;
+        leaves[k] = left[x];
+        leaves[numberOfLeaves++] = right[x];
+      }
+      if (numberOfLeaves < 3)
+        continue;
+
+      // Subsets are numbered so that the subsets of a set precede it
+      const auto all = (1 << numberOfLeaves) - 1;
+
+      for (int set = 1; set <= all; ++set)
+      {
+        if ((set & (set - 1)) == 0)
+        {
+          auto j = 0;
+
+          while ((set >> j) != 1)
+            ++j;
+          setBounds[set] = bounds[leaves[j]];
+          setCost[set] = cost[leaves[j]];
+          continue;
+        }
+
+        const auto low = set & -set;
+
+        setBounds[set] = setBounds[low];
+        setBounds[set].inflate(setBounds[set ^ low]);
+
+        // Each partition is tried once, with the lowest leaf on the left
+        auto minCost = math::Limits<float>::inf();
+
+        for (auto part = (set - 1) & set; part != 0; part = (part - 1) & set)
+          if ((part & low) != 0)
+          {
+            auto c = setCost[part] + setCost[set ^ part];
+
+            if (c < minCost)
+            {
+              minCost = c;
+              setSplit[set] = part;
+            }
+          }
+        setCost[set] = ct * setBounds[set].area() + minCost;
+      }
+      // Float noise must not flip treelets back and forth
+      if (!(setCost[all] < cost[root] * 0.9999f))
+        continue;
+
+      auto next = 1;
+      auto rebuild = [&](auto& self, int set, int node) -> void
+      {
+        const int parts[2]{setSplit[set], set ^ setSplit[set]};
+        int children[2];
+
+        for (int c = 0; c < 2; ++c)
+          if ((parts[c] & (parts[c] - 1)) == 0)
+          {
+            auto j = 0;
+
+            while ((parts[c] >> j) != 1)
+              ++j;
+            children[c] = leaves[j];
+          }
+          else
+          {
+            children[c] = interiors[next++];
+            self(self, parts[c], children[c]);
+          }
+        left[node] = children[0];
+        right[node] = children[1];
+        bounds[node] = setBounds[set];
+        cost[node] = setCost[set];
+      };
+
+      rebuild(rebuild, all, root);
+      changed = true;
+    }
+    if (!changed)
+      break;
+  }
+
+  // Emit the nodes in depth-first order again. Leaves keep their
+  // triangles; the axis of a node is the one along which the centers
+  // of its children are farthest apart, the lower child coming first
+  NodeArray nodes;
+  struct Entry
+  {
+    int node;
+    int parent; // node whose second child is this one, if any
+    int depth;
+  };
+  std::vector<Entry> entries{{0, -1, 0}};
+
+  nodes.reserve(n);
+  while (!entries.empty())
+  {
+    auto e = entries.back();
+
+    entries.pop_back();
+    // Give up if the treelets made the tree too deep to traverse
+    if (e.depth >= BVH_MAX_DEPTH)
+      return;
+    if (e.parent >= 0)
+      nodes[e.parent].secondChild = int(nodes.size());
+    if (left[e.node] < 0)
+    {
+      nodes.push_back(_nodes[e.node]);
+      continue;
+    }
+
+    auto l = left[e.node];
+    auto r = right[e.node];
+    auto d = bounds[r].center() - bounds[l].center();
+    auto axis = abs(d.x) > abs(d.y) && abs(d.x) > abs(d.z) ? 0 :
+      (abs(d.y) > abs(d.z) ? 1 : 2);
+
+    if (d[axis] < 0)
+      std::swap(l, r);
+
+    auto& node = nodes.emplace_back();
+
+    node.bounds = bounds[e.node];
+    node.count = 0;
+    node.axis = uint8_t(axis);
+    node.pad = 0;
+    entries.push_back({r, int(nodes.size()) - 1, e.depth + 1});
+    entries.push_back({l, -1, e.depth + 1});
+  }
+  _nodes.swap(nodes);
+}
+
+
+BVH::BVH(TriangleMesh& mesh, int maxTrisPerNode):
+  BVH{mesh, BVHParams{BVHSplitMethod::Median, maxTrisPerNode}}
+{
+  // do nothing
+}
+
+BVH::BVH(TriangleMesh& mesh, const BVHParams& params):
+  _mesh{&mesh},
+  _params{params}
+{
+  _params.maxTrisPerNode = std::max(1,
+    std::min(_params.maxTrisPerNode, BVH_MAX_LEAF_SIZE));
+  _params.maxDuplication = std::max(0.0f,
+    std::min(_params.maxDuplication, BVH_MAX_DUPLICATION));
+  _params.quantization = _params.quantization <= 0 ? 0 :
+    _params.quantization <= 8 ? 8 : 16;
+  build();
+  compact();
+}
+
+BVH::BVH(TriangleMesh& mesh,
+  const BVHParams& params,
+  const char* cacheDirectory):
+  _mesh{&mesh},
+  _params{params}
+{
+  namespace fs = std::filesystem;
+
+  _params.maxTrisPerNode = std::max(1,
+    std::min(_params.maxTrisPerNode, BVH_MAX_LEAF_SIZE));
+  _params.maxDuplication = std::max(0.0f,
+    std::min(_params.maxDuplication, BVH_MAX_DUPLICATION));
+  _params.quantization = _params.quantization <= 0 ? 0 :
+    _params.quantization <= 8 ? 8 : 16;
+
+  char name[32];
+
+  snprintf(name,
+    sizeof name,
+    "%016llx.bvh",
+    (unsigned long long)cacheKey(mesh, _params));
+
+  auto filename = (fs::path{cacheDirectory} / name).string();
+
+  _cached = read(filename.c_str());
+  if (!_cached)
+  {
+    build();
+
+    std::error_code e;
+
+    fs::create_directories(cacheDirectory, e);
+    write(filename.c_str());
+  }
+  compact();
+}
+
+void
+BVH::build()
+{
+  static_assert(sizeof(Node) == 32, "BVH::Node must be 32 bytes long");
+
+  auto& mesh = *_mesh;
+  const auto& data = mesh.data();
+  int nt{data.numberOfTriangles};
+
+  _meshVersion = mesh.version();
+  _buildTime = 0;
+  if (nt == 0)
+    return;
+
+  const auto start = std::chrono::steady_clock::now();
+  Reference<ThreadPool> pool;
+
+  if (nt >= BVH_PARALLEL_MIN_TRIS && _params.numberOfThreads != 1)
+    pool = new ThreadPool{_params.numberOfThreads};
+
+  TriangleInfoArray triangleInfo(nt);
+
+  parallelFor(pool, nt, [&](int begin, int end)
+  {
+    for (int i = begin; i < end; ++i)
+    {
+      auto t = data.triangles + i;
+      Bounds3f b;
+
+      b.inflate(data.vertices[t->v[0]]);
+      b.inflate(data.vertices[t->v[1]]);
+      b.inflate(data.vertices[t->v[2]]);
+      triangleInfo[i] = {i, b};
+    }
+  });
+
+  MortonCodeArray mortonCodes;
+
+  if (_params.splitMethod == BVHSplitMethod::LBVH)
+    sortByMortonCodes(triangleInfo, mortonCodes, pool);
+
+  BuildState state{triangleInfo, mortonCodes.data(), pool, 0, 0};
+  Subtree root;
+  // Leaves of an SBVH may reference a triangle more than once
+  const auto nr = maxReferenceCount();
+
+  if (mortonCodes.empty())
+    state.mortonCodes = nullptr;
+  root.nodes.reserve(2 * nr - 1);
+  root.tris.reserve(nr);
+  _spatialSplitStats = {};
+  if (_params.splitMethod != BVHSplitMethod::SBVH)
+    makeNode(root, state, 0, nt, 0, -1);
+  else
+  {
+    Bounds3f b;
+
+    for (const auto& t : triangleInfo)
+      b.inflate(t.bounds);
+    state.rootArea = b.area();
+    makeSpatialNode(root, state, triangleInfo, nr - nt, 0, -1);
+  }
+  if (pool != nullptr)
+    state.wait();
+  // A binary tree with nr leaves at most has 2 * nr - 1 nodes, so the
+  // node array is allocated once and never grows while flattened
+  _nodes.reserve(2 * nr - 1);
+  flatten(root);
+  _nodes.shrink_to_fit();
+  if (_params.splitMethod == BVHSplitMethod::SBVH)
+    _spatialSplitStats.referenceCount = int(_triangles.size()) - nt -
+      int(std::count(_triangles.begin(), _triangles.end(), -1));
+  if (state.mortonCodes != nullptr)
+    updateInteriorBounds();
+  restructureTreelets(_params.treeletPasses);
+  buildTriangleGroups(pool);
+  _builtSahCost = _sahCost = computeSAHCost();
+  // The gain of spatial splits is measured on request (it takes a
+  // second build, see spatialSplitStats())
+  _spatialSplitStats.sahCostSaved = _spatialSplitStats.splitCount > 0 ?
+    std::numeric_limits<float>::quiet_NaN() : 0;
+  buildWideNodes();
+  _buildTime += std::chrono::duration<float>{
+    std::chrono::steady_clock::now() - start}.count();
+#ifdef _DEBUG
+  if (true)
+  {
+    mesh.bounds().print("Mesh bounds:");
+    printf("Mesh triangles: %d\n", nt);
+    bounds().print("BVH bounds:");
+    stats().print();
+    if (_params.splitMethod == BVHSplitMethod::SBVH)
+    {
+      const auto& ss = spatialSplitStats();
+
+      printf("BVH spatial splits: %d (%d references added, SAH cost %g saved)\n",
+        ss.splitCount,
+        ss.referenceCount,
+        ss.sahCostSaved);
+    }
+    putchar('\n');
+  }
+#endif // _DEBUG
+}
+
+BVH::~BVH()
+{
+  // do nothing
+}
+
+const BVHSpatialSplitStats&
+BVH::spatialSplitStats() const
+{
+  if (std::isnan(_spatialSplitStats.sahCostSaved))
+  {
+    // The gain is measured against the tree the same build would
+    // output without spatial splits
+    auto params = _params;
+
+    params.maxDuplication = 0;
+    params.width = 2;
+
+    Reference<BVH> bvh = new BVH{*_mesh, params};
+
+    _spatialSplitStats.sahCostSaved = bvh->_sahCost - _builtSahCost;
+  }
+  return _spatialSplitStats;
+}
+
+void
+BVH::rebuild()
+{
+  _nodes.clear();
+  _triangles.clear();
+  _groups.clear();
+  _cached = false;
+  build();
+  compact();
+}
+
+void
+BVH::refit()
+{
+  if (_nodes.empty())
+    return rebuild();
+
+  const auto& data = _mesh->data();
+
+  for (auto& node : _nodes)
+  {
+    if (!node.isLeaf())
+      continue;
+    node.bounds.setEmpty();
+    for (int i = node.first, e = i + node.count; i < e; ++i)
+    {
+      auto v = data.triangles[_triangles[i]].v;
+
+      node.bounds.inflate(data.vertices[v[0]]);
+      node.bounds.inflate(data.vertices[v[1]]);
+      node.bounds.inflate(data.vertices[v[2]]);
+    }
+  }
+  updateInteriorBounds();
+  buildTriangleGroups(nullptr);
+  _sahCost = computeSAHCost();
+  buildWideNodes();
+  _meshVersion = _mesh->version();
+}
+
+bool
+BVH::update()
+{
+  if (_meshVersion == _mesh->version())
+    return false;
+  refit();
+  if (_sahCost > _params.rebuildThreshold * _builtSahCost)
+    rebuild();
+  return true;
+}
+
+Bounds3f
+BVH::bounds() const
+{
+  if (!_nodes.empty())
+    return _nodes[0].bounds;
+
+  // The root of a compact tree is the first quantized node
+  Bounds3f b;
+  auto root = [&b](const auto& nodes)
+  {
+    if (!nodes.empty())
+      for (int k = 0; k < nodes[0].width; ++k)
+        if (nodes[0].child[k] >= 0)
+          b.inflate(nodes[0].bounds(k));
+  };
+
+  root(_nodes4q8);
+  root(_nodes4q16);
+  root(_nodes8q8);
+  root(_nodes8q16);
+  return b;
+}
+
+void
+BVH::iterate(BVHNodeFunction f) const
+{
+  // Nodes are already stored in depth-first order
+  for (const auto& node : _nodes)
+    f({node.bounds, node.isLeaf(), node.first, node.count});
+  if (!_nodes.empty() || _groups.empty())
+    return;
+
+  // A compact tree reports its root followed by the decoded children
+  // of its quantized nodes
+  auto children = [&f](const auto& nodes)
+  {
+    for (const auto& node : nodes)
+      for (int k = 0; k < node.width; ++k)
+        if (node.child[k] >= 0)
+          f({node.bounds(k), node.count[k] > 0, node.child[k], node.count[k]});
+  };
+
+  f({bounds(), false, 0, 0});
+  children(_nodes4q8);
+  children(_nodes4q16);
+  children(_nodes8q8);
+  children(_nodes8q16);
+}
+
+BVHStats
+BVH::stats() const
+{
+  BVHStats s{};
+  auto add = [&s](int depth, int count, bool isLeaf)
+  {
+    if (depth >= int(s.depthHistogram.size()))
+      s.depthHistogram.resize(depth + 1);
+    ++s.depthHistogram[depth];
+    ++s.nodeCount;
+    if (!isLeaf)
+      return;
+    if (count >= int(s.leafSizeHistogram.size()))
+      s.leafSizeHistogram.resize(count + 1);
+    ++s.leafSizeHistogram[count];
+    ++s.leafCount;
+  };
+  // The children of a wide node are either leaves or wide nodes
+  auto wide = [&add](const auto& nodes)
+  {
+    std::vector<std::pair<int, int>> stack{{0, 0}};
+
+    while (!stack.empty())
+    {
+      auto [i, depth] = stack.back();
+
+      stack.pop_back();
+      add(depth, 0, false);
+
+      const auto& node = nodes[i];
+
+      for (int k = 0; k < node.width; ++k)
+      {
+        if (node.child[k] < 0)
+          continue;
+        if (node.count[k] > 0)
+          add(depth + 1, node.count[k], true);
+        else
+          stack.push_back({node.child[k], depth + 1});
+      }
+    }
+  };
+
+  // Same precedence as intersect()
+  if (!_nodes4.empty())
+    wide(_nodes4);
+  else if (!_nodes8.empty())
+    wide(_nodes8);
+  else if (!_nodes4q8.empty())
+    wide(_nodes4q8);
+  else if (!_nodes4q16.empty())
+    wide(_nodes4q16);
+  else if (!_nodes8q8.empty())
+    wide(_nodes8q8);
+  else if (!_nodes8q16.empty())
+    wide(_nodes8q16);
+  else if (!_nodes.empty())
+  {
+    std::vector<std::pair<int, int>> stack{{0, 0}};
+
+    while (!stack.empty())
+    {
+      auto [i, depth] = stack.back();
+      const auto& node = _nodes[i];
+
+      stack.pop_back();
+      add(depth, node.count, node.isLeaf());
+      if (!node.isLeaf())
+      {
+        stack.push_back({node.secondChild, depth + 1});
+        stack.push_back({i + 1, depth + 1});
+      }
+    }
+  }
+  s.sahCost = _sahCost;
+  s.memoryBytes = nodeBytes() +
+    sizeof(int) * _triangles.size() +
+    sizeof(TriangleGroup) * _groups.size();
+  s.buildTime = _cached ? 0 : _buildTime;
+  readRayCounters(s);
+  return s;
+}
+
+void
+BVH::readRayCounters(BVHStats& s) const
+{
+#ifdef BVH_RAY_COUNTERS
+  s.rayCount = _rayCount;
+  s.nodesVisited = _nodesVisited;
+  s.trianglesTested = _trianglesTested;
+#else
+  (void)s;
+#endif // BVH_RAY_COUNTERS
+}
+
+void
+BVH::resetRayCounters()
+{
+#ifdef BVH_RAY_COUNTERS
+  _rayCount = _nodesVisited = _trianglesTested = 0;
+#endif // BVH_RAY_COUNTERS
+}
+
+void
+BVHStats::print(FILE* f) const
+{
+  fprintf(f, "BVH nodes: %d (%d leaves)\n", nodeCount, leafCount);
+  fprintf(f, "BVH max depth: %d\n", maxDepth());
+  fprintf(f, "BVH SAH cost: %g\n", sahCost);
+  fprintf(f, "BVH memory: %zu bytes\n", memoryBytes);
+  fprintf(f, "BVH build time: %g s\n", buildTime);
+  fprintf(f, "BVH nodes per depth:");
+  for (auto n : depthHistogram)
+    fprintf(f, " %d", n);
+  fprintf(f, "\nBVH leaves per triangle count:");
+  for (size_t i = 0; i < leafSizeHistogram.size(); ++i)
+    if (leafSizeHistogram[i] > 0)
+      fprintf(f, " %zu:%d", i, leafSizeHistogram[i]);
+  fputc('\n', f);
+  if (rayCount > 0)
+    fprintf(f,
+      "BVH rays: %llu (%g nodes visited, %g triangles tested per ray)\n",
+      (unsigned long long)rayCount,
+      nodesVisitedPerRay(),
+      trianglesTestedPerRay());
+}
+
+// Cache file layout: header followed by the node, triangle index and
+// triangle group arrays, each starting at a 64-byte boundary. Bump the
+// version whenever the layout or the build algorithm changes
+#define BVH_CACHE_MAGIC 0x48435642 // "BVCH" in little-endian
+#define BVH_CACHE_VERSION 2
+#define BVH_CACHE_ALIGNMENT 64
+
+struct BVHCacheHeader
+{
+  uint32_t magic;
+  uint32_t version;
+  uint64_t key;
+  uint32_t nodeSize;
+  uint32_t groupSize;
+  int32_t numberOfTriangles; // of the mesh
+  int32_t nodeCount;
+  int32_t triangleCount; // including padding indices
+  int32_t groupCount;
+  float sahCost;
+  int32_t spatialSplitCount;
+  int32_t referenceCount;
+  float sahCostSaved;
+  uint32_t reserved[2];
+
+}; // BVHCacheHeader
+
+inline size_t
+cacheAlign(size_t offset)
+{
+  return (offset + BVH_CACHE_ALIGNMENT - 1) & ~size_t(BVH_CACHE_ALIGNMENT - 1);
+}
+
+// 64-bit FNV-1a
+inline uint64_t
+fnv1a(uint64_t h, const void* data, size_t size)
+{
+  auto p = static_cast<const unsigned char*>(data);
+
+  for (auto e = p + size; p != e; ++p)
+    h = (h ^ *p) * 0x100000001b3ull;
+  return h;
+}
+
+template <typename T>
+inline uint64_t
+fnv1a(uint64_t h, const T& value)
+{
+  return fnv1a(h, &value, sizeof value);
+}
+
+uint64_t
+BVH::cacheKey(const TriangleMesh& mesh, const BVHParams& params)
+{
+  const auto& data = mesh.data();
+  auto h = 0xcbf29ce484222325ull;
+
+  h = fnv1a(h, data.numberOfVertices);
+  h = fnv1a(h, data.numberOfTriangles);
+  h = fnv1a(h, data.vertices, sizeof(vec3f) * data.numberOfVertices);
+  h = fnv1a(h,
+    data.triangles,
+    sizeof(TriangleMesh::Triangle) * data.numberOfTriangles);
+  // Fields are hashed one by one to skip padding bytes
+  h = fnv1a(h, int(params.splitMethod));
+  h = fnv1a(h, params.maxTrisPerNode);
+  h = fnv1a(h, params.numberOfBins);
+  h = fnv1a(h, params.traversalCost);
+  h = fnv1a(h, params.intersectionCost);
+  h = fnv1a(h, params.mortonBits);
+  h = fnv1a(h, params.treeletPasses);
+  h = fnv1a(h, params.maxDuplication);
+  h = fnv1a(h, params.spatialSplitAlpha);
+  h = fnv1a(h, BVH_GROUP_SIZE);
+#ifdef BVH_SCALAR_LEAVES
+  h = fnv1a(h, 1);
+#endif // BVH_SCALAR_LEAVES
+  return h;
+}
+
+bool
+BVH::write(const char* filename) const
+{
+  // The binary nodes of a compact tree are gone
+  if (_nodes.empty() && !_groups.empty())
+    return false;
+
+  BVHCacheHeader header{};
+
+  header.magic = BVH_CACHE_MAGIC;
+  header.version = BVH_CACHE_VERSION;
+  header.key = cacheKey(*_mesh, _params);
+  header.nodeSize = sizeof(Node);
+  header.groupSize = BVH_GROUP_SIZE;
+  header.numberOfTriangles = _mesh->data().numberOfTriangles;
+  header.nodeCount = int32_t(_nodes.size());
+  header.triangleCount = int32_t(_triangles.size());
+  header.groupCount = int32_t(_groups.size());
+  header.sahCost = _sahCost;
+  header.spatialSplitCount = _spatialSplitStats.splitCount;
+  header.referenceCount = _spatialSplitStats.referenceCount;
+  header.sahCostSaved = _spatialSplitStats.sahCostSaved;
+
+  // The file is written aside and renamed, so a valid cache is never
+  // seen half written
+  auto temp = std::string{filename} + ".tmp";
+  auto file = fopen(temp.c_str(), "wb");
+
+  if (file == nullptr)
+    return false;
+
+  size_t offset = 0;
+  auto put = [&](const void* data, size_t size)
+  {
+    static const char zeros[BVH_CACHE_ALIGNMENT]{};
+    auto ok = fwrite(zeros, 1, cacheAlign(offset) - offset, file) ==
+      cacheAlign(offset) - offset &&
+      fwrite(data, 1, size, file) == size;
+
+    offset = cacheAlign(offset) + size;
+    return ok;
+  };
+  auto ok = put(&header, sizeof header) &&
+    put(_nodes.data(), sizeof(Node) * _nodes.size()) &&
+    put(_triangles.data(), sizeof(int) * _triangles.size()) &&
+    put(_groups.data(), sizeof(TriangleGroup) * _groups.size());
+
+  ok = fclose(file) == 0 && ok;
+
+  std::error_code e;
+
+  if (ok)
+    std::filesystem::rename(temp, filename, e);
+  if (!ok || e)
+  {
+    std::filesystem::remove(temp, e);
+    return false;
+  }
+  return true;
+}
+
+bool
+BVH::read(const char* filename)
+{
+  MappedFile file{filename};
+
+  if (!file.isOpen() || file.size() < sizeof(BVHCacheHeader))
+    return false;
+
+  auto base = static_cast<const char*>(file.data());
+  BVHCacheHeader header;
+
+  memcpy(&header, base, sizeof header);
+
+  const auto nt = _mesh->data().numberOfTriangles;
+  const auto nr = maxReferenceCount();
+
+  if (header.magic != BVH_CACHE_MAGIC ||
+    header.version != BVH_CACHE_VERSION ||
+    header.nodeSize != sizeof(Node) ||
+    header.groupSize != BVH_GROUP_SIZE ||
+    header.numberOfTriangles != nt ||
+    header.nodeCount < 0 || header.nodeCount > 2 * std::max(nr, 1) ||
+    header.triangleCount != header.groupCount * BVH_GROUP_SIZE ||
+    header.groupCount < 0 || header.groupCount > nr ||
+    header.key != cacheKey(*_mesh, _params))
+    return false;
+
+  auto nodeOffset = cacheAlign(sizeof header);
+  auto triangleOffset = cacheAlign(nodeOffset +
+    sizeof(Node) * header.nodeCount);
+  auto groupOffset = cacheAlign(triangleOffset +
+    sizeof(int) * header.triangleCount);
+
+  if (file.size() != groupOffset + sizeof(TriangleGroup) * header.groupCount)
+    return false;
+  // The arrays are copied out of the view, since the tree owns them
+  auto nodes = reinterpret_cast<const Node*>(base + nodeOffset);
+
+  _nodes.assign(nodes, nodes + header.nodeCount);
+  _triangles.resize(header.triangleCount);
+  memcpy(_triangles.data(),
+    base + triangleOffset,
+    sizeof(int) * _triangles.size());
+  _groups.resize(header.groupCount);
+  memcpy(_groups.data(),
+    base + groupOffset,
+    sizeof(TriangleGroup) * _groups.size());
+  _builtSahCost = _sahCost = header.sahCost;
+  _spatialSplitStats = {header.spatialSplitCount,
+    header.referenceCount,
+    header.sahCostSaved};
+  _meshVersion = _mesh->version();
+
+  // Indices are checked, so that a damaged file cannot crash traversal.
+  // Children follow their parents, so depths are settled in one forward
+  // pass; deeper trees would overflow the traversal stacks
+  auto valid = true;
+  std::vector<int> depth(_nodes.size());
+
+  for (int i = 0, n = int(_nodes.size()); i < n && valid; ++i)
+  {
+    const auto& node = _nodes[i];
+
+    if (node.isLeaf())
+      valid = node.first >= 0 && node.first % BVH_GROUP_SIZE == 0 &&
+        node.first + node.count <= header.triangleCount;
+    else if ((valid = node.secondChild > i + 1 && node.secondChild < n &&
+      node.axis < 3 && depth[i] + 1 < BVH_MAX_DEPTH))
+    {
+      depth[i + 1] = std::max(depth[i + 1], depth[i] + 1);
+      depth[node.secondChild] = std::max(depth[node.secondChild],
+        depth[i] + 1);
+    }
+  }
+  for (auto i : _triangles)
+    valid &= i >= -1 && i < nt;
+  // Group lanes are hit.triangleIndex and occluders, so they must match
+  // the (checked) triangle indices
+  for (int i = 0, n = int(_triangles.size()); i < n && valid; ++i)
+    valid = _groups[i / BVH_GROUP_SIZE].index[i % BVH_GROUP_SIZE] ==
+      _triangles[i];
+  if (!valid)
+  {
+    _nodes.clear();
+    _triangles.clear();
+    _groups.clear();
+    _sahCost = 0;
+  }
+  else
+    buildWideNodes();
+  return valid;
+}
+
+// Moller-Trumbore ray/triangle test with precomputed edges
+inline bool
+mollerTrumbore(const vec3f& o,
+  const vec3f& D,
+  const vec3f& p0,
+  const vec3f& e1,
+  const vec3f& e2,
+  float& t,
+  float& b1,
+  float& b2)
+{
+  auto s1 = D.cross(e2);
+  auto s1e1 = s1.dot(e1);
+
+  if (math::isZero(abs(s1e1)))
+    return false;
+
+  auto invd = 1 / s1e1;
+  auto s = o - p0;
+
+  b1 = s1.dot(s) * invd;
+  if (!std::isgreaterequal(b1, 0.0f))
+    return false;
+
+  auto s2 = s.cross(e1);
+
+  b2 = s2.dot(D) * invd;
+  if (!std::isgreaterequal(b2, 0.0f) || std::isgreater(b1 + b2, 1.0f))
+    return false;
+  t = s2.dot(e2) * invd;
+  return std::isgreaterequal(t, 0.0f);
+}
+
+inline bool
+intersectTriangle(const vec3f& o,
+  const vec3f& D,
+  const vec3f& p0,
+  const vec3f& p1,
+  const vec3f& p2,
+  float& t,
+  float& b1,
+  float& b2)
+{
+  return mollerTrumbore(o, D, p0, p1 - p0, p2 - p0, t, b1, b2);
+}
+
+#if defined(BVH_SIMD_AVX2) || defined(BVH_SIMD_SSE)
+
+#ifdef BVH_SIMD_AVX2
+using floatv = __m256;
+
+#define setv _mm256_set1_ps
+#define loadv _mm256_load_ps
+#define storev _mm256_storeu_ps
+#define addv _mm256_add_ps
+#define subv _mm256_sub_ps
+#define mulv _mm256_mul_ps
+#define divv _mm256_div_ps
+#define andv _mm256_and_ps
+#define andnotv _mm256_andnot_ps
+#define gev(a, b) _mm256_cmp_ps(a, b, _CMP_GE_OQ)
+#define lev(a, b) _mm256_cmp_ps(a, b, _CMP_LE_OQ)
+#define gtv(a, b) _mm256_cmp_ps(a, b, _CMP_GT_OQ)
+#define maskv _mm256_movemask_ps
+#else
+using floatv = __m128;
+
+#define setv _mm_set1_ps
+#define loadv _mm_load_ps
+#define storev _mm_storeu_ps
+#define addv _mm_add_ps
+#define subv _mm_sub_ps
+#define mulv _mm_mul_ps
+#define divv _mm_div_ps
+#define andv _mm_and_ps
+#define andnotv _mm_andnot_ps
+#define gev _mm_cmpge_ps
+#define lev _mm_cmple_ps
+#define gtv _mm_cmpgt_ps
+#define maskv _mm_movemask_ps
+#endif // BVH_SIMD_AVX2
+
+inline floatv
+dotv(floatv ax, floatv ay, floatv az, floatv bx, floatv by, floatv bz)
+{
+  return addv(addv(mulv(ax, bx), mulv(ay, by)), mulv(az, bz));
+}
+
+inline floatv
+crossv(floatv a, floatv b, floatv c, floatv d)
+{
+  return subv(mulv(a, b), mulv(c, d));
+}
+
+int
+BVH::TriangleGroup::intersect(const vec3f& o,
+  const vec3f& D,
+  float* t,
+  float* b1,
+  float* b2) const
+{
+  // Same operations, in the same order, as the scalar test
+  const auto dx = setv(D.x), dy = setv(D.y), dz = setv(D.z);
+  const auto e1x = loadv(e1[0]), e1y = loadv(e1[1]), e1z = loadv(e1[2]);
+  const auto e2x = loadv(e2[0]), e2y = loadv(e2[1]), e2z = loadv(e2[2]);
+  const auto s1x = crossv(dy, e2z, dz, e2y);
+  const auto s1y = crossv(dz, e2x, dx, e2z);
+  const auto s1z = crossv(dx, e2y, dy, e2x);
+  const auto s1e1 = dotv(s1x, s1y, s1z, e1x, e1y, e1z);
+  const auto zero = setv(0);
+  auto hit = gtv(andnotv(setv(-0.0f), s1e1), setv(math::Limits<float>::eps()));
+  const auto invd = divv(setv(1), s1e1);
+  const auto sx = subv(setv(o.x), loadv(p0[0]));
+  const auto sy = subv(setv(o.y), loadv(p0[1]));
+  const auto sz = subv(setv(o.z), loadv(p0[2]));
+  const auto u = mulv(dotv(s1x, s1y, s1z, sx, sy, sz), invd);
+  const auto s2x = crossv(sy, e1z, sz, e1y);
+  const auto s2y = crossv(sz, e1x, sx, e1z);
+  const auto s2z = crossv(sx, e1y, sy, e1x);
+  const auto v = mulv(dotv(s2x, s2y, s2z, dx, dy, dz), invd);
+  const auto d = mulv(dotv(s2x, s2y, s2z, e2x, e2y, e2z), invd);
+
+  hit = andv(hit, andv(gev(u, zero), gev(v, zero)));
+  hit = andv(hit, andv(lev(addv(u, v), setv(1)), gev(d, zero)));
+  storev(t, d);
+  storev(b1, u);
+  storev(b2, v);
+  return maskv(hit);
+}
+
+#else // scalar fallback
+
+int
+BVH::TriangleGroup::intersect(const vec3f& o,
+  const vec3f& D,
+  float* t,
+  float* b1,
+  float* b2) const
+{
+  auto mask = 0;
+
+  for (int k = 0; k < BVH_GROUP_SIZE; ++k)
+    if (mollerTrumbore(o,
+      D,
+      {p0[0][k], p0[1][k], p0[2][k]},
+      {e1[0][k], e1[1][k], e1[2][k]},
+      {e2[0][k], e2[1][k], e2[2][k]},
+      t[k],
+      b1[k],
+      b2[k]))
+      mask |= 1 << k;
+  return mask;
+}
+
+#endif // BVH_SIMD_AVX2 || BVH_SIMD_SSE
+
+#ifdef BVH_RAY_COUNTERS
+
+// Counts of the rays being traced by the calling thread
+static thread_local uint64_t threadNodesVisited;
+static thread_local uint64_t threadTrianglesTested;
+
+#define BVH_COUNT_NODE() ++threadNodesVisited
+#define BVH_COUNT_TRIANGLES(n) threadTrianglesTested += (n)
+
+// Adds the counts of a traversal to the counters of the tree
+class BVH::RayCounter
+{
+public:
+  RayCounter(const BVH& bvh, int rayCount):
+    _bvh{bvh},
+    _rayCount{rayCount}
+  {
+    threadNodesVisited = threadTrianglesTested = 0;
+  }
+
+  ~RayCounter()
+  {
+    const auto order = std::memory_order_relaxed;
+
+    _bvh._rayCount.fetch_add(_rayCount, order);
+    _bvh._nodesVisited.fetch_add(threadNodesVisited, order);
+    _bvh._trianglesTested.fetch_add(threadTrianglesTested, order);
+  }
+
+private:
+  const BVH& _bvh;
+  int _rayCount;
+
+}; // BVH::RayCounter
+
+#define BVH_COUNT_RAYS(n) RayCounter rayCounter{*this, n}
+
+inline int
+countRays(int mask)
+{
+  auto n = 0;
+
+  for (; mask != 0; mask &= mask - 1)
+    ++n;
+  return n;
+}
+
+#else
+
+#define BVH_COUNT_NODE()
+#define BVH_COUNT_TRIANGLES(n)
+#define BVH_COUNT_RAYS(n)
+
+#endif // BVH_RAY_COUNTERS
+
+inline bool
+BVH::intersectLeaf(int first,
+  int count,
+  const Ray& ray,
+  Intersection& hit,
+  float d) const
+{
+  auto ret = false;
+
+  BVH_COUNT_TRIANGLES(count);
+#ifdef BVH_SCALAR_LEAVES
+  const auto& data = _mesh->data();
+
+  for (int i = first, e = i + count; i < e; ++i)
+  {
+    auto v = data.triangles[_triangles[i]].v;
+    float t, b1, b2;
+
+    if (!intersectTriangle(ray.origin,
+      ray.direction,
+      data.vertices[v[0]],
+      data.vertices[v[1]],
+      data.vertices[v[2]],
+      t,
+      b1,
+      b2))
+      continue;
+
+    auto dist = t * d;
+
+    if (dist > hit.distance)
+      continue;
+    hit.triangleIndex = _triangles[i];
+    hit.distance = dist;
+    hit.p = vec3f{1 - b1 - b2, b1, b2};
+    ret = true;
+  }
+#else
+  auto g = _groups.data() + first / BVH_GROUP_SIZE;
+  auto ge = g + (count + BVH_GROUP_SIZE - 1) / BVH_GROUP_SIZE;
+
+  for (; g != ge; ++g)
+  {
+    float t[BVH_GROUP_SIZE], b1[BVH_GROUP_SIZE], b2[BVH_GROUP_SIZE];
+    auto mask = g->intersect(ray.origin, ray.direction, t, b1, b2);
+
+    // Lanes are checked in triangle order, as in the scalar path
+    for (int k = 0; mask != 0; ++k, mask >>= 1)
+    {
+      if ((mask & 1) == 0)
+        continue;
+
+      auto dist = t[k] * d;
+
+      if (dist > hit.distance)
+        continue;
+      hit.triangleIndex = g->index[k];
+      hit.distance = dist;
+      hit.p = vec3f{1 - b1[k] - b2[k], b1[k], b2[k]};
+      ret = true;
+    }
+  }
+#endif // BVH_SCALAR_LEAVES
+  return ret;
+}
+
+bool
+BVH::intersect(const Node* node,
+  const Ray& ray,
+  Intersection& hit,
+  float d) const
+{
+  // Closest hits are searched from the ray origin on
+  const RayPrecomputed r{ray, 0, math::Limits<float>::inf()};
+  const Node* stack[BVH_MAX_DEPTH];
+  auto top = 0;
+  auto ret = false;
+
+  for (;;)
+  {
+    float tMin, tMax;
+
+    ++hit.nodesVisited;
+    BVH_COUNT_NODE();
+    // Skip nodes behind the ray or farther than the closest hit so far
+    if (node->bounds.intersect(r, tMin, tMax) && tMin * d <= hit.distance)
+    {
+      if (!node->isLeaf())
+      {
+        // Visit the child nearer to the ray origin first
+        auto second = _nodes.data() + node->secondChild;
+
+        if (r.sign[node->axis])
+        {
+          stack[top++] = node + 1;
+          node = second;
+        }
+        else
+        {
+          stack[top++] = second;
+          ++node;
+        }
+        continue;
+      }
+      if (intersectLeaf(node->first, node->count, ray, hit, d))
+        ret = true;
+    }
+    if (top == 0)
+      break;
+    node = stack[--top];
+  }
+  return ret;
+}
+
+bool
+BVH::intersect(const Ray& ray, Intersection& hit, float d) const
+{
+  BVH_COUNT_RAYS(1);
+  if (!_nodes4.empty())
+    return intersect(_nodes4, ray, hit, d);
+  if (!_nodes8.empty())
+    return intersect(_nodes8, ray, hit, d);
+  if (!_nodes4q8.empty())
+    return intersect(_nodes4q8, ray, hit, d);
+  if (!_nodes4q16.empty())
+    return intersect(_nodes4q16, ray, hit, d);
+  if (!_nodes8q8.empty())
+    return intersect(_nodes8q8, ray, hit, d);
+  if (!_nodes8q16.empty())
+    return intersect(_nodes8q16, ray, hit, d);
+  return !_nodes.empty() && intersect(_nodes.data(), ray, hit, d);
+}
+
+int
+BVH::intersect(const RayPacket& packet, int mask, Intersection* hits) const
+//[]---------------------------------------------------[]
+//|  Packet intersection                                |
+//|  @param packet rays and their bounds                |
+//|  @param mask rays of the packet to be traced        |
+//|  @param hits closest hits of the rays (in/out)      |
+//|  @return mask of the rays whose hit was updated     |
+//|                                                     |
+//|  Every ray visits the same nodes in the same order  |
+//|  as if traced alone: the packet follows the shared  |
+//|  near-first order and each stack entry keeps the    |
+//|  rays that entered the node, so the hits are those  |
+//|  of intersect(ray, hit, d).                         |
+//[]---------------------------------------------------[]
+{
+  if (mask == 0)
+    return 0;
+
+  auto ret = 0;
+
+  // Rays of incoherent packets or of compact trees are traced alone
+  if (!packet.isCoherent() || _nodes.empty())
+  {
+    for (int k = 0; k < packet.size; ++k)
+      if ((mask & (1 << k)) != 0 &&
+        intersect(packet.rays[k], hits[k], packet.d[k]))
+        ret |= 1 << k;
+    return ret;
+  }
+
+  BVH_COUNT_RAYS(countRays(mask));
+
+  struct Entry
+  {
+    const Node* node;
+    int mask;
+  };
+
+  Entry stack[BVH_MAX_DEPTH];
+  auto top = 0;
+  auto node = _nodes.data();
+
+  for (;;)
+  {
+    auto first = 0;
+    auto distance = 0.0f;
+
+    while ((mask & (1 << first)) == 0)
+      ++first;
+    ++hits[first].nodesVisited;
+    BVH_COUNT_NODE();
+    for (int k = first; k < packet.size; ++k)
+      if ((mask & (1 << k)) != 0)
+        distance = std::max(distance, hits[k].distance);
+    // Cull the whole packet first, then the rays one by one
+    if (!packet.misses(node->bounds, distance))
+    {
+      float tMin[RAY_PACKET_SIZE], tMax[RAY_PACKET_SIZE];
+      auto active = 0;
+      auto count = 0;
+
+      packet.intersect(node->bounds, tMin, tMax);
+      for (int k = first; k < packet.size; ++k)
+      {
+        if ((mask & (1 << k)) != 0 &&
+          tMin[k] <= tMax[k] &&
+          tMax[k] >= 0 && tMin[k] * packet.d[k] <= hits[k].distance)
+        {
+          active |= 1 << k;
+          ++count;
+        }
+      }
+      if (count > 0 && count < RAY_PACKET_MIN_ACTIVE)
+      {
+        // The packet has diverged: trace the subtree ray by ray
+        for (int k = first; k < packet.size; ++k)
+          if ((active & (1 << k)) != 0 &&
+            intersect(node, packet.rays[k], hits[k], packet.d[k]))
+            ret |= 1 << k;
+      }
+      else if (count > 0)
+      {
+        if (!node->isLeaf())
+        {
+          auto second = _nodes.data() + node->secondChild;
+
+          if (packet.isDirNeg(node->axis))
+          {
+            stack[top++] = {node + 1, active};
+            node = second;
+          }
+          else
+          {
+            stack[top++] = {second, active};
+            ++node;
+          }
+          mask = active;
+          continue;
+        }
+        for (int k = first; k < packet.size; ++k)
+          if ((active & (1 << k)) != 0 &&
+            intersectLeaf(node->first,
+              node->count,
+              packet.rays[k],
+              hits[k],
+              packet.d[k]))
+            ret |= 1 << k;
+      }
+    }
+    if (top == 0)
+      break;
+    --top;
+    node = stack[top].node;
+    mask = stack[top].mask;
+  }
+  return ret;
+}
+
+template <int N>
+int
+BVH::intersectBoxes(const float bounds[2][3][N],
+  const RayPrecomputed& ray,
+  float tMin,
+  float tMax,
+  float d,
+  float* tEntry)
+{
+  auto mask = 0;
+
+  for (int k = 0; k < N; ++k)
+  {
+    auto entry = -math::Limits<float>::inf();
+    auto exit = +math::Limits<float>::inf();
+
+    for (int i = 0; i < 3; ++i)
+    {
+      auto o = ray.origin[i];
+
+      entry = std::max(entry, (bounds[ray.sign[i]][i][k] - o) * ray.inverse[i]);
+      exit = std::min(exit, (bounds[1 - ray.sign[i]][i][k] - o) * ray.inverse[i]);
+    }
+    tEntry[k] = entry;
+    if (entry <= exit && exit >= tMin && entry * d <= tMax)
+      mask |= 1 << k;
+  }
+  return mask;
+}
+
+#if defined(BVH_SIMD_AVX2) || defined(BVH_SIMD_SSE)
+// Tests the boxes whose near and far planes along axis i start at
+// lo[i] and hi[i], four at a time
+inline int
+intersectBoxes4(const float* const lo[3],
+  const float* const hi[3],
+  const float* origin,
+  const float* inverse,
+  float tMin,
+  float tMax,
+  float d,
+  float* tEntry)
+{
+  __m128 entry, exit;
+
+  for (int i = 0; i < 3; ++i)
+  {
+    auto o = _mm_set1_ps(origin[i]);
+    auto inv = _mm_set1_ps(inverse[i]);
+    auto tNear = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(lo[i]), o), inv);
+    auto tFar = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(hi[i]), o), inv);
+
+    entry = i == 0 ? tNear : _mm_max_ps(entry, tNear);
+    exit = i == 0 ? tFar : _mm_min_ps(exit, tFar);
+  }
+  _mm_storeu_ps(tEntry, entry);
+
+  auto hit = _mm_and_ps(_mm_cmple_ps(entry, exit),
+    _mm_cmpge_ps(exit, _mm_set1_ps(tMin)));
+
+  hit = _mm_and_ps(hit,
+    _mm_cmple_ps(_mm_mul_ps(entry, _mm_set1_ps(d)), _mm_set1_ps(tMax)));
+  return _mm_movemask_ps(hit);
+}
+
+template <>
+int
+BVH::intersectBoxes<4>(const float bounds[2][3][4],
+  const RayPrecomputed& ray,
+  float tMin,
+  float tMax,
+  float d,
+  float* tEntry)
+{
+  const float* lo[3];
+  const float* hi[3];
+
+  for (int i = 0; i < 3; ++i)
+  {
+    lo[i] = bounds[ray.sign[i]][i];
+    hi[i] = bounds[1 - ray.sign[i]][i];
+  }
+  return intersectBoxes4(lo,
+    hi,
+    (const float*)ray.origin,
+    (const float*)ray.inverse,
+    tMin,
+    tMax,
+    d,
+    tEntry);
+}
+
+template <>
+int
+BVH::intersectBoxes<8>(const float bounds[2][3][8],
+  const RayPrecomputed& ray,
+  float tMin,
+  float tMax,
+  float d,
+  float* tEntry)
+{
+#ifdef BVH_SIMD_AVX2
+  __m256 entry, exit;
+
+  for (int i = 0; i < 3; ++i)
+  {
+    auto o = _mm256_set1_ps(ray.origin[i]);
+    auto inv = _mm256_set1_ps(ray.inverse[i]);
+    auto tNear = _mm256_mul_ps(_mm256_sub_ps(
+      _mm256_load_ps(bounds[ray.sign[i]][i]), o), inv);
+    auto tFar = _mm256_mul_ps(_mm256_sub_ps(
+      _mm256_load_ps(bounds[1 - ray.sign[i]][i]), o), inv);
+
+    entry = i == 0 ? tNear : _mm256_max_ps(entry, tNear);
+    exit = i == 0 ? tFar : _mm256_min_ps(exit, tFar);
+  }
+  _mm256_storeu_ps(tEntry, entry);
+
+  auto hit = _mm256_and_ps(_mm256_cmp_ps(entry, exit, _CMP_LE_OQ),
+    _mm256_cmp_ps(exit, _mm256_set1_ps(tMin), _CMP_GE_OQ));
+
+  hit = _mm256_and_ps(hit,
+    _mm256_cmp_ps(_mm256_mul_ps(entry, _mm256_set1_ps(d)),
+      _mm256_set1_ps(tMax),
+      _CMP_LE_OQ));
+  return _mm256_movemask_ps(hit);
+#else
+  const float* lo[3];
+  const float* hi[3];
+
+  for (int i = 0; i < 3; ++i)
+  {
+    lo[i] = bounds[ray.sign[i]][i];
+    hi[i] = bounds[1 - ray.sign[i]][i];
+  }
+
+  auto mask = intersectBoxes4(lo,
+    hi,
+    (const float*)ray.origin,
+    (const float*)ray.inverse,
+    tMin,
+    tMax,
+    d,
+    tEntry);
+
+  for (int i = 0; i < 3; ++i)
+  {
+    lo[i] += 4;
+    hi[i] += 4;
+  }
+  return mask | intersectBoxes4(lo,
+    hi,
+    (const float*)ray.origin,
+    (const float*)ray.inverse,
+    tMin,
+    tMax,
+    d,
+    tEntry + 4) << 4;
+#endif // BVH_SIMD_AVX2
+}
+#endif // BVH_SIMD_AVX2 || BVH_SIMD_SSE
+
+template <int N>
+inline int
+BVH::WideNode<N>::intersect(const RayPrecomputed& ray,
+  float tMin,
+  float tMax,
+  float d,
+  float* tEntry) const
+{
+  return intersectBoxes<N>(bounds, ray, tMin, tMax, d, tEntry);
+}
+
+// Spacing of the grid of a quantized node given its biased exponent
+inline float
+gridSpacing(int exponent)
+{
+  auto bits = uint32_t(exponent) << 23;
+  float s;
+
+  memcpy(&s, &bits, sizeof s);
+  return s;
+}
+
+template <int N, typename Q>
+inline void
+BVH::QuantizedNode<N, Q>::decode(float b[2][3][N]) const
+{
+  for (int i = 0; i < 3; ++i)
+  {
+    auto o = origin[i];
+    auto s = gridSpacing(exponent[i]);
+
+    // Planes times spacing are exact, so the decoded planes are
+    // rounded once, fused or not
+    for (int j = 0; j < 2; ++j)
+      for (int k = 0; k < N; ++k)
+        b[j][i][k] = o + float(planes[j][i][k]) * s;
+  }
+}
+
+template <int N, typename Q>
+Bounds3f
+BVH::QuantizedNode<N, Q>::bounds(int k) const
+{
+  alignas(32) float b[2][3][N];
+
+  decode(b);
+  return {{b[0][0][k], b[0][1][k], b[0][2][k]},
+    {b[1][0][k], b[1][1][k], b[1][2][k]}};
+}
+
+#if defined(BVH_SIMD_AVX2) || defined(BVH_SIMD_SSE)
+inline __m128
+loadPlanes4(const uint8_t* q)
+{
+  int32_t x;
+
+  memcpy(&x, q, sizeof x);
+
+  auto z = _mm_setzero_si128();
+
+  return _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(
+    _mm_cvtsi32_si128(x), z), z));
+}
+
+inline __m128
+loadPlanes4(const uint16_t* q)
+{
+  auto x = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(q));
+
+  return _mm_cvtepi32_ps(_mm_unpacklo_epi16(x, _mm_setzero_si128()));
+}
+#endif // BVH_SIMD_AVX2 || BVH_SIMD_SSE
+
+template <int N, typename Q>
+inline int
+BVH::QuantizedNode<N, Q>::intersect(const RayPrecomputed& ray,
+  float tMin,
+  float tMax,
+  float d,
+  float* tEntry) const
+{
+#if defined(BVH_SIMD_AVX2) || defined(BVH_SIMD_SSE)
+  // Four children at a time, decoded as decode() does and tested as
+  // intersectBoxes() does
+  __m128 o[3], s[3], p[3], inv[3];
+
+  for (int i = 0; i < 3; ++i)
+  {
+    o[i] = _mm_set1_ps(origin[i]);
+    s[i] = _mm_set1_ps(gridSpacing(exponent[i]));
+    p[i] = _mm_set1_ps(ray.origin[i]);
+    inv[i] = _mm_set1_ps(ray.inverse[i]);
+  }
+
+  auto mask = 0;
+
+  for (int k = 0; k < N; k += 4)
+  {
+    __m128 entry, exit;
+
+    for (int i = 0; i < 3; ++i)
+    {
+      auto lo = _mm_add_ps(o[i],
+        _mm_mul_ps(loadPlanes4(planes[ray.sign[i]][i] + k), s[i]));
+      auto hi = _mm_add_ps(o[i],
+        _mm_mul_ps(loadPlanes4(planes[1 - ray.sign[i]][i] + k), s[i]));
+      auto tNear = _mm_mul_ps(_mm_sub_ps(lo, p[i]), inv[i]);
+      auto tFar = _mm_mul_ps(_mm_sub_ps(hi, p[i]), inv[i]);
+
+      entry = i == 0 ? tNear : _mm_max_ps(entry, tNear);
+      exit = i == 0 ? tFar : _mm_min_ps(exit, tFar);
+    }
+    _mm_storeu_ps(tEntry + k, entry);
+
+    auto hit = _mm_and_ps(_mm_cmple_ps(entry, exit),
+      _mm_cmpge_ps(exit, _mm_set1_ps(tMin)));
+
+    hit = _mm_and_ps(hit,
+      _mm_cmple_ps(_mm_mul_ps(entry, _mm_set1_ps(d)), _mm_set1_ps(tMax)));
+    mask |= _mm_movemask_ps(hit) << k;
+  }
+  return mask;
+#else
+  alignas(32) float b[2][3][N];
+
+  decode(b);
+  return intersectBoxes<N>(b, ray, tMin, tMax, d, tEntry);
+#endif // BVH_SIMD_AVX2 || BVH_SIMD_SSE
+}
+
+template <int N>
+void
+BVH::collapse(WideNodeArray<N>& nodes) const
+{
+  nodes.clear();
+  if (_nodes.empty())
+    return;
+
+  // Pairs of binary node and wide node built from it
+  std::vector<std::pair<int, int>> work{{0, 0}};
+
+  nodes.emplace_back();
+  while (!work.empty())
+  {
+    auto [b, w] = work.back();
+    int children[N]{b};
+    int n = 1;
+
+    work.pop_back();
+    // Open the interior child of largest area until the node is full
+    if (!_nodes[b].isLeaf())
+    {
+      children[0] = b + 1;
+      children[1] = _nodes[b].secondChild;
+      for (n = 2; n < N; ++n)
+      {
+        auto k = -1;
+        auto maxArea = -1.0f;
+
+        for (int j = 0; j < n; ++j)
+        {
+          const auto& c = _nodes[children[j]];
+
+          if (!c.isLeaf() && c.bounds.area() > maxArea)
+          {
+            maxArea = c.bounds.area();
+            k = j;
+          }
+        }
+        if (k < 0)
+          break;
+
+        auto c = children[k];
+
+        children[k] = c + 1;
+        children[n] = _nodes[c].secondChild;
+      }
+    }
+
+    WideNode<N> node;
+
+    for (int k = 0; k < N; ++k)
+    {
+      if (k >= n)
+      {
+        for (int i = 0; i < 3; ++i)
+        {
+          node.bounds[0][i][k] = +math::Limits<float>::inf();
+          node.bounds[1][i][k] = -math::Limits<float>::inf();
+        }
+        node.child[k] = -1;
+        node.count[k] = 0;
+        continue;
+      }
+
+      const auto& c = _nodes[children[k]];
+
+      for (int i = 0; i < 3; ++i)
+      {
+        node.bounds[0][i][k] = c.bounds.min()[i];
+        node.bounds[1][i][k] = c.bounds.max()[i];
+      }
+      if (c.isLeaf())
+      {
+        node.child[k] = c.first;
+        node.count[k] = c.count;
+      }
+      else
+      {
+        node.child[k] = int(nodes.size());
+        node.count[k] = 0;
+        work.emplace_back(children[k], node.child[k]);
+        nodes.emplace_back();
+      }
+    }
+    nodes[w] = node;
+  }
+  nodes.shrink_to_fit();
+}
+
+#define BVH_PAGE_SIZE 4096
+
+template <int N>
+void
+BVH::reorder(WideNodeArray<N>& nodes, size_t nodeSize) const
+{
+  const auto layout = _params.layout;
+
+  if (layout == BVHNodeLayout::DepthFirst || nodes.size() < 2)
+    return;
+
+  // New order of the nodes; the root stays first
+  std::vector<int> order;
+
+  order.reserve(nodes.size());
+  if (layout == BVHNodeLayout::VanEmdeBoas)
+  {
+    auto height = 0;
+
+    // Height of the tree
+    for (std::vector<int> level{0}, next; !level.empty(); ++height)
+    {
+      next.clear();
+      for (auto i : level)
+        for (int k = 0; k < N; ++k)
+          if (nodes[i].child[k] >= 0 && nodes[i].count[k] == 0)
+            next.push_back(nodes[i].child[k]);
+      level.swap(next);
+    }
+
+    // Lays out the top half of the levels of the subtree of root, then
+    // each subtree hanging from it, recursively
+    auto veb = [&nodes, &order](const auto& self, int root, int levels)
+    {
+      if (levels == 1)
+      {
+        order.push_back(root);
+        return;
+      }
+
+      auto top = levels / 2;
+      std::vector<int> bottom{root};
+      std::vector<int> next;
+
+      self(self, root, top);
+      for (int l = 0; l < top; ++l)
+      {
+        next.clear();
+        for (auto i : bottom)
+          for (int k = 0; k < N; ++k)
+            if (nodes[i].child[k] >= 0 && nodes[i].count[k] == 0)
+              next.push_back(nodes[i].child[k]);
+        bottom.swap(next);
+      }
+      for (auto i : bottom)
+        self(self, i, levels - top);
+    };
+
+    veb(veb, 0, height);
+  }
+  else
+  {
+    // Clusters grow from their roots through the child of largest box
+    // until they fill a page. The children left out are the roots of
+    // the next clusters, visited depth-first
+    const auto clusterSize = std::max<size_t>(1, BVH_PAGE_SIZE / nodeSize);
+    std::vector<int> roots{0};
+    std::vector<std::pair<float, int>> front;
+
+    while (!roots.empty())
+    {
+      auto cluster = order.size();
+
+      front.assign(1, {0.0f, roots.back()});
+      roots.pop_back();
+      while (!front.empty() && order.size() - cluster < clusterSize)
+      {
+        std::pop_heap(front.begin(), front.end());
+
+        auto i = front.back().second;
+
+        front.pop_back();
+        order.push_back(i);
+
+        const auto& node = nodes[i];
+
+        for (int k = 0; k < N; ++k)
+          if (node.child[k] >= 0 && node.count[k] == 0)
+          {
+            vec3f p1{node.bounds[0][0][k],
+              node.bounds[0][1][k],
+              node.bounds[0][2][k]};
+            vec3f p2{node.bounds[1][0][k],
+              node.bounds[1][1][k],
+              node.bounds[1][2][k]};
+
+            front.emplace_back(Bounds3f{p1, p2}.area(), node.child[k]);
+            std::push_heap(front.begin(), front.end());
+          }
+      }
+      // The smallest ones are pushed first, so the largest is next
+      std::sort(front.begin(), front.end());
+      for (const auto& f : front)
+        roots.push_back(f.second);
+    }
+  }
+
+  std::vector<int> index(nodes.size());
+  WideNodeArray<N> reordered(nodes.size());
+
+  for (int i = 0, n = int(order.size()); i < n; ++i)
+    index[order[i]] = i;
+  for (int i = 0, n = int(order.size()); i < n; ++i)
+  {
+    auto& node = reordered[i] = nodes[order[i]];
+
+    for (int k = 0; k < N; ++k)
+      if (node.child[k] >= 0 && node.count[k] == 0)
+        node.child[k] = index[node.child[k]];
+  }
+  nodes.swap(reordered);
+}
+
+template <int N, typename Q>
+void
+BVH::quantize(QuantizedNodeArray<N, Q>& nodes) const
+{
+  WideNodeArray<N> wideNodes;
+
+  collapse(wideNodes);
+  reorder(wideNodes, sizeof(QuantizedNode<N, Q>));
+  nodes.resize(wideNodes.size());
+
+  constexpr auto qMax = std::numeric_limits<Q>::max();
+
+  for (size_t n = 0; n < nodes.size(); ++n)
+  {
+    const auto& w = wideNodes[n];
+    auto& q = nodes[n];
+
+    for (int k = 0; k < N; ++k)
+    {
+      q.child[k] = w.child[k];
+      q.count[k] = w.count[k];
+    }
+    q.pad = 0;
+    for (int i = 0; i < 3; ++i)
+    {
+      auto lo = +math::Limits<float>::inf();
+      auto hi = -math::Limits<float>::inf();
+
+      for (int k = 0; k < N; ++k)
+        if (w.child[k] >= 0)
+        {
+          lo = std::min(lo, w.bounds[0][i][k]);
+          hi = std::max(hi, w.bounds[1][i][k]);
+        }
+
+      // Start from the smallest power of two spacing whose grid spans
+      // [lo, hi], and coarsen it if rounding makes a plane overflow
+      int e;
+
+      std::frexp((hi - lo) / qMax, &e);
+      q.origin[i] = lo;
+      for (e = std::min(std::max(e + 127, 1), 254);; ++e)
+      {
+        const auto s = gridSpacing(e);
+        auto fits = true;
+
+        for (int k = 0; k < N && fits; ++k)
+        {
+          if (w.child[k] < 0)
+          {
+            // Inverted box: never hit
+            q.planes[0][i][k] = qMax;
+            q.planes[1][i][k] = 0;
+            continue;
+          }
+
+          auto qLo = std::max(std::floor((w.bounds[0][i][k] - lo) / s), 0.0f);
+          auto qHi = std::ceil((w.bounds[1][i][k] - lo) / s);
+
+          // Round outwards as decode() does
+          while (qLo > 0 && lo + qLo * s > w.bounds[0][i][k])
+            --qLo;
+          while (qHi <= qMax && lo + qHi * s < w.bounds[1][i][k])
+            ++qHi;
+          if (!(qHi <= qMax))
+            fits = false;
+          else
+          {
+            q.planes[0][i][k] = Q(qLo);
+            q.planes[1][i][k] = Q(qHi);
+          }
+        }
+        if (fits || e == 254)
+          break;
+      }
+      q.exponent[i] = uint8_t(e);
+    }
+  }
+  nodes.shrink_to_fit();
+}
+
+void
+BVH::buildWideNodes()
+{
+  _nodes4.clear();
+  _nodes8.clear();
+  _nodes4q8.clear();
+  _nodes4q16.clear();
+  _nodes8q8.clear();
+  _nodes8q16.clear();
+  if (_params.quantization == 8)
+  {
+    if (_params.width == 8)
+      quantize(_nodes8q8);
+    else
+      quantize(_nodes4q8);
+  }
+  else if (_params.quantization == 16)
+  {
+    if (_params.width == 8)
+      quantize(_nodes8q16);
+    else
+      quantize(_nodes4q16);
+  }
+  else if (_params.width == 4)
+  {
+    collapse(_nodes4);
+    reorder(_nodes4, sizeof(WideNode<4>));
+  }
+  else if (_params.width == 8)
+  {
+    collapse(_nodes8);
+    reorder(_nodes8, sizeof(WideNode<8>));
+  }
+  // Revisions are unique among all trees, so that a tree allocated
+  // where a deleted one was is not taken for it
+  static std::atomic<uint32_t> revisions;
+
+  _revision = ++revisions;
+}
+
+void
+BVH::compact()
+{
+  if (_params.quantization != 0)
+    NodeArray{}.swap(_nodes);
+}
+
+size_t
+BVH::nodeBytes() const
+{
+  return sizeof(Node) * _nodes.size() +
+    sizeof(WideNode<4>) * _nodes4.size() +
+    sizeof(WideNode<8>) * _nodes8.size() +
+    sizeof(QuantizedNode<4, uint8_t>) * _nodes4q8.size() +
+    sizeof(QuantizedNode<4, uint16_t>) * _nodes4q16.size() +
+    sizeof(QuantizedNode<8, uint8_t>) * _nodes8q8.size() +
+    sizeof(QuantizedNode<8, uint16_t>) * _nodes8q16.size();
+}
+
+template <typename T>
+bool
+BVH::intersect(const std::vector<T>& nodes,
+  const Ray& ray,
+  Intersection& hit,
+  float d) const
+{
+  constexpr auto N = T::width;
+
+  struct Entry
+  {
+    int child;
+    int count;
+    float tEntry;
+  };
+
+  // A visit pushes all but one of its children, at most
+  Entry stack[BVH_MAX_DEPTH * (N - 1)];
+  const RayPrecomputed r{ray};
+  Entry e{0, 0, 0};
+  auto top = 0;
+  auto ret = false;
+
+  for (;;)
+  {
+    if (e.count > 0)
+    {
+      if (intersectLeaf(e.child, e.count, ray, hit, d))
+        ret = true;
+    }
+    else
+    {
+      const auto& node = nodes[e.child];
+      float tEntry[N];
+      Entry hits[N];
+      auto n = 0;
+
+      ++hit.nodesVisited;
+      BVH_COUNT_NODE();
+
+      auto mask = node.intersect(r, 0, hit.distance, d, tEntry);
+
+      // Children hit are sorted from the farthest to the nearest one
+      for (int k = 0; mask != 0; ++k, mask >>= 1)
+        if ((mask & 1) != 0)
+        {
+          Entry c{node.child[k], node.count[k], tEntry[k]};
+          auto j = n++;
+
+          for (; j > 0 && hits[j - 1].tEntry < c.tEntry; --j)
+            hits[j] = hits[j - 1];
+          hits[j] = c;
+        }
+      if (n > 0)
+      {
+        // Visit the nearest child next and the others in order
+        for (int j = 0; j < n - 1; ++j)
+          stack[top++] = hits[j];
+        e = hits[n - 1];
+        continue;
+      }
+    }
+    // Skip children farther than the closest hit found meanwhile
+    do
+    {
+      if (top == 0)
+        return ret;
+      e = stack[--top];
+    } while (e.tEntry * d > hit.distance);
+  }
+}
+
+template <typename T>
+int
+BVH::occluder(const std::vector<T>& nodes, const Ray& ray) const
+{
+  constexpr auto N = T::width;
+
+  struct Entry
+  {
+    int child;
+    int count;
+  };
+
+  Entry stack[BVH_MAX_DEPTH * (N - 1) + 1];
+  const RayPrecomputed r{ray};
+  auto top = 0;
+
+  stack[top++] = {0, 0};
+  while (top > 0)
+  {
+    auto e = stack[--top];
+
+    if (e.count > 0)
+    {
+      auto i = occluderLeaf(e.child, e.count, ray);
+
+      if (i >= 0)
+        return i;
+      continue;
+    }
+
+    const auto& node = nodes[e.child];
+    float tEntry[N];
+
+    BVH_COUNT_NODE();
+
+    auto mask = node.intersect(r, ray.tMin, ray.tMax, 1, tEntry);
+
+    for (int k = 0; mask != 0; ++k, mask >>= 1)
+      if ((mask & 1) != 0)
+        stack[top++] = {node.child[k], node.count[k]};
+  }
+  return -1;
+}
+
+int
+BVH::occluderLeaf(int first, int count, const Ray& ray) const
+{
+  BVH_COUNT_TRIANGLES(count);
+#ifdef BVH_SCALAR_LEAVES
+  const auto& data = _mesh->data();
+
+  for (int i = first, e = i + count; i < e; ++i)
+  {
+    auto v = data.triangles[_triangles[i]].v;
+    float t, b1, b2;
+
+    // Any hit within the ray extent will do
+    if (intersectTriangle(ray.origin,
+      ray.direction,
+      data.vertices[v[0]],
+      data.vertices[v[1]],
+      data.vertices[v[2]],
+      t,
+      b1,
+      b2) && t >= ray.tMin && t <= ray.tMax)
+      return _triangles[i];
+  }
+#else
+  auto g = _groups.data() + first / BVH_GROUP_SIZE;
+  auto ge = g + (count + BVH_GROUP_SIZE - 1) / BVH_GROUP_SIZE;
+
+  for (; g != ge; ++g)
+  {
+    float t[BVH_GROUP_SIZE], b1[BVH_GROUP_SIZE], b2[BVH_GROUP_SIZE];
+    auto mask = g->intersect(ray.origin, ray.direction, t, b1, b2);
+
+    // Any hit within the ray extent will do
+    for (int k = 0; mask != 0; ++k, mask >>= 1)
+      if ((mask & 1) != 0 && t[k] >= ray.tMin && t[k] <= ray.tMax)
+        return g->index[k];
+  }
+#endif // BVH_SCALAR_LEAVES
+  return -1;
+}
+
+bool
+BVH::occludedBy(int triangle, const Ray& ray) const
+{
+  const auto& data = _mesh->data();
+  auto v = data.triangles[triangle].v;
+  float t, b1, b2;
+
+  BVH_COUNT_TRIANGLES(1);
+  return intersectTriangle(ray.origin,
+    ray.direction,
+    data.vertices[v[0]],
+    data.vertices[v[1]],
+    data.vertices[v[2]],
+    t,
+    b1,
+    b2) && t >= ray.tMin && t <= ray.tMax;
+}
+
+int
+BVH::occluder(const Ray& ray) const
+{
+  BVH_COUNT_RAYS(1);
+  if (!_nodes4.empty())
+    return occluder(_nodes4, ray);
+  if (!_nodes8.empty())
+    return occluder(_nodes8, ray);
+  if (!_nodes4q8.empty())
+    return occluder(_nodes4q8, ray);
+  if (!_nodes4q16.empty())
+    return occluder(_nodes4q16, ray);
+  if (!_nodes8q8.empty())
+    return occluder(_nodes8q8, ray);
+  if (!_nodes8q16.empty())
+    return occluder(_nodes8q16, ray);
+  if (_nodes.empty())
+    return -1;
+
+  const RayPrecomputed r{ray};
+  const Node* stack[BVH_MAX_DEPTH];
+  auto top = 0;
+  auto node = _nodes.data();
+
+  for (;;)
+  {
+    float tMin, tMax;
+
+    BVH_COUNT_NODE();
+    if (node->bounds.intersect(r, tMin, tMax))
+    {
+      if (!node->isLeaf())
+      {
+        stack[top++] = _nodes.data() + node->secondChild;
+        ++node;
+        continue;
+      }
+
+      auto i = occluderLeaf(node->first, node->count, ray);
+
+      if (i >= 0)
+        return i;
+    }
+    if (top == 0)
+      break;
+    node = stack[--top];
+  }
+  return -1;
 }
 
 } // end namespace cg
@@ -34,13 +34,18 @@
 #define __BVH_h
 
 #include "graphics/GLMesh.h"
+#include "BVHNode.h"
 #include "Intersection.h"
+#include "RayPacket.h"
+#include <atomic>
+#include <cstdio>
 #include <functional>
-#include <stack>
 
 namespace cg
 { // begin namespace cg
 
+class ThreadPool;
+
 struct BVHNodeInfo
 {
   Bounds3f bounds;
@@ -52,10 +57,127 @@ struct BVHNodeInfo
 
 using BVHNodeFunction = std::function<void(const BVHNodeInfo&)>;
 
+#define BVH_MAX_BINS 64
+#define BVH_MAX_LEAF_SIZE 0xffff
+#define BVH_MAX_DEPTH 64
+// Upper bound of BVHParams::maxDuplication
+#define BVH_MAX_DUPLICATION 2.0f
+// Builds of meshes with fewer triangles are serial; larger subtrees
+// are built by parallel tasks
+#define BVH_PARALLEL_MIN_TRIS 4096
+
+// Leaf triangles are tested in groups by a SIMD kernel picked at build
+// time: AVX2 (8 lanes) when enabled (e.g., /arch:AVX2), SSE (4 lanes)
+// on x86/x64 or a scalar loop otherwise. Define BVH_SCALAR_LEAVES to
+// test them one by one through the triangle index array (reference)
+#if defined(__AVX2__)
+#define BVH_GROUP_SIZE 8
+#else
+#define BVH_GROUP_SIZE 4
+#endif
+
+enum class BVHSplitMethod
+{
+  Median,
+  SAH,
+  LBVH, // linear BVH from Morton-sorted centroids (fast, lower quality)
+  SBVH // SAH with spatial splits (duplicates triangle references)
+};
+
+// Order of the wide nodes in memory. The binary nodes are always in
+// depth-first order, since a first child follows its parent
+enum class BVHNodeLayout
+{
+  DepthFirst,
+  VanEmdeBoas, // recursive top/bottom halves (cache oblivious)
+  Clustered // subtrees of largest child boxes filling memory pages
+};
+
+struct BVHParams
+{
+  BVHSplitMethod splitMethod{BVHSplitMethod::Median};
+  int maxTrisPerNode{16};
+  int numberOfBins{16}; // SAH only
+  float traversalCost{1}; // SAH cost of a node traversal step
+  float intersectionCost{1}; // SAH cost of a ray/triangle (group) test
+  int numberOfThreads{0}; // build threads (0 = one per core)
+  int mortonBits{30}; // LBVH only: 30 or 63 bits Morton codes
+  int treeletPasses{0}; // treelet restructuring passes after the build
+  float rebuildThreshold{1.5f}; // see BVH::update()
+  int width{2}; // children per node traversed by rays: 2, 4 or 8
+  float maxDuplication{0.3f}; // SBVH only: max references added per triangle
+  float spatialSplitAlpha{1e-5f}; // SBVH only: min child overlap area (relative
+                                  // to the root) to try spatial splits
+  int quantization{0}; // bits of the child boxes of wide nodes: 0 (float),
+                       // 8 or 16 (see BVH::compact())
+  BVHNodeLayout layout{BVHNodeLayout::DepthFirst}; // of the wide nodes
+
+}; // BVHParams
+
+// Spatial splits of an SBVH build
+struct BVHSpatialSplitStats
+{
+  int splitCount; // nodes split by a spatial split
+  int referenceCount; // triangle references added to the leaves
+  float sahCostSaved; // SAH cost of the tree built without spatial splits
+                      // minus the one of the SBVH
+
+}; // BVHSpatialSplitStats
+
+// Define BVH_RAY_COUNTERS to count the nodes visited and triangles
+// tested by the rays traced through each tree (see BVH::stats()).
+// Counting costs an atomic update per ray
+
+// Shape, size and cost of the tree traversed by rays (the wide one,
+// if any)
+struct BVHStats
+{
+  int nodeCount; // interior nodes and leaves
+  int leafCount;
+  std::vector<int> depthHistogram; // number of nodes at each depth
+  std::vector<int> leafSizeHistogram; // number of leaves with each
+                                      // triangle (reference) count
+  float sahCost;
+  size_t memoryBytes; // nodes, triangle indices and triangle groups
+  float buildTime; // in seconds, 0 if the tree was loaded from a cache
+  // Ray counters, 0 unless BVH_RAY_COUNTERS is defined
+  uint64_t rayCount; // rays traced (closest hit and occlusion)
+  uint64_t nodesVisited;
+  uint64_t trianglesTested; // triangles of the leaves reached
+
+  int maxDepth() const
+  {
+    return int(depthHistogram.size()) - 1;
+  }
+
+  float nodesVisitedPerRay() const
+  {
+    return rayCount ? float(nodesVisited) / rayCount : 0;
+  }
+
+  float trianglesTestedPerRay() const
+  {
+    return rayCount ? float(trianglesTested) / rayCount : 0;
+  }
+
+  void print(FILE* f = stdout) const;
+
+}; // BVHStats
+
 class BVH: public SharedObject
 {
 public:
   BVH(TriangleMesh& mesh, int maxTrisPerNode = 16);
+  BVH(TriangleMesh& mesh, const BVHParams& params);
+  /// Loads the tree from a binary file in cacheDirectory named after
+  /// cacheKey(). If the file is missing or invalid, the tree is built
+  /// and saved there.
+  BVH(TriangleMesh& mesh,
+    const BVHParams& params,
+    const char* cacheDirectory);
+
+  /// Returns a hash of the mesh data and build parameters.
+  static uint64_t cacheKey(const TriangleMesh& mesh, const BVHParams& params);
 
   ~BVH() override;
 
@@ -64,37 +186,292 @@ public:
     return _mesh;
   }
 
+  const BVHParams& params() const
+  {
+    return _params;
+  }
+
+  /// Returns the SAH cost of the tree relative to its root bounds.
+  float sahCost() const
+  {
+    return _sahCost;
+  }
+
+  /// Returns the number of binary nodes, 0 if compact() released them.
+  int nodeCount() const
+  {
+    return int(_nodes.size());
+  }
+
+  /// Returns the size in bytes of the node arrays.
+  size_t nodeBytes() const;
+
+  /// Returns the spatial splits of an SBVH build. The first call after
+  /// a build with splits measures sahCostSaved by building the tree
+  /// again without them.
+  const BVHSpatialSplitStats& spatialSplitStats() const;
+
+  /// Returns the mesh version the tree was built or refit for.
+  uint32_t meshVersion() const
+  {
+    return _meshVersion;
+  }
+
+  /// Returns a number that changes whenever the nodes change (build,
+  /// load or refit), so that data derived from the tree can be cached.
+  /// No two trees share a revision.
+  uint32_t revision() const
+  {
+    return _revision;
+  }
+
+  /// Returns true if the tree was loaded from a cache file.
+  bool isCached() const
+  {
+    return _cached;
+  }
+
+  /// Returns the time in seconds the last build took.
+  float buildTime() const
+  {
+    return _buildTime;
+  }
+
   Bounds3f bounds() const;
   void iterate(BVHNodeFunction f) const;
 
+  BVHStats stats() const;
+
+  /// Copies the ray counters into s without walking the tree.
+  void readRayCounters(BVHStats& s) const;
+
+  /// Zeroes the ray counters reported by stats().
+  void resetRayCounters();
+
+  /// Writes the tree to a binary cache file.
+  bool write(const char* filename) const;
+
+  /// Recomputes the node bounds from the current vertex positions of
+  /// the mesh, keeping the topology of the tree. A compact tree is
+  /// rebuilt instead.
+  void refit();
+
+  /// Refits the tree if the mesh has changed since the tree was built
+  /// or refit. If the SAH cost of the refit tree exceeds the cost of
+  /// the built one by more than params().rebuildThreshold times, the
+  /// tree is rebuilt. Returns true if the tree has changed.
+  bool update();
+
   bool intersect(const Ray& ray, Intersection& hit, float d) const;
-	
+
+  /// Intersects the rays of a packet selected by mask. Returns the
+  /// mask of the rays whose hit was updated.
+  int intersect(const RayPacket& packet, int mask, Intersection* hits) const;
+
+  /// Returns true if any triangle is hit within [ray.tMin, ray.tMax].
+  bool occluded(const Ray& ray) const
+  {
+    return occluder(ray) >= 0;
+  }
+
+  /// Returns the index of a triangle hit within [ray.tMin, ray.tMax],
+  /// not necessarily the closest one, or -1 if there is none.
+  int occluder(const Ray& ray) const;
+
+  /// Returns true if the triangle is hit within [ray.tMin, ray.tMax].
+  bool occludedBy(int triangle, const Ray& ray) const;
+
 private:
-  struct Node;
+  // Leaves reference ranges of _triangles
+  using Node = BVHNode;
+
+  // N-wide node collapsed from the binary tree. Child bounds are SoA,
+  // so that one SIMD sequence tests all children; unused slots have
+  // empty bounds and never hit
+  template <int N>
+  struct alignas(32) WideNode
+  {
+    static constexpr int width = N;
 
+    float bounds[2][3][N]; // [min/max][axis][child]
+    int child[N]; // wide node or first triangle of a leaf, -1 if unused
+    uint16_t count[N]; // number of triangles of a leaf, 0 otherwise
+
+    /// Returns the mask of the children hit within [tMin, tMax]. The
+    /// entry parameters are scaled by d before compared to tMax.
+    int intersect(const RayPrecomputed& ray,
+      float tMin,
+      float tMax,
+      float d,
+      float* tEntry) const;
+
+  }; // WideNode
+
+  template <int N> using WideNodeArray = std::vector<WideNode<N>>;
+
+  // Tests the N boxes of a wide node at once (SIMD for N = 4 and 8),
+  // as Bounds3f::intersect(const RayPrecomputed&, ...) does for one
+  template <int N>
+  static int intersectBoxes(const float bounds[2][3][N],
+    const RayPrecomputed& ray,
+    float tMin,
+    float tMax,
+    float d,
+    float* tEntry);
+
+  // N-wide node whose child boxes are quantized to the bits of Q. The
+  // planes lie on a grid with origin at the min corner of the node and
+  // a power of two spacing; they are rounded outwards, so the decoded
+  // boxes contain the float ones
+  template <int N, typename Q>
+  struct alignas(16) QuantizedNode
+  {
+    static constexpr int width = N;
+
+    float origin[3];
+    uint8_t exponent[3]; // biased exponents of the grid spacing
+    uint8_t pad;
+    Q planes[2][3][N]; // [min/max][axis][child], in grid steps
+    int child[N]; // as in WideNode
+    uint16_t count[N];
+
+    void decode(float b[2][3][N]) const;
+    Bounds3f bounds(int k) const;
+    int intersect(const RayPrecomputed& ray,
+      float tMin,
+      float tMax,
+      float d,
+      float* tEntry) const;
+
+  }; // QuantizedNode
+
+  template <int N, typename Q>
+  using QuantizedNodeArray = std::vector<QuantizedNode<N, Q>>;
+
+  // Leaf triangles in SoA form. The triangles of a leaf start at a
+  // group boundary; unused lanes have null edges and never hit
+  struct alignas(4 * BVH_GROUP_SIZE) TriangleGroup
+  {
+    float p0[3][BVH_GROUP_SIZE];
+    float e1[3][BVH_GROUP_SIZE];
+    float e2[3][BVH_GROUP_SIZE];
+    int index[BVH_GROUP_SIZE];
+
+    int intersect(const vec3f& o,
+      const vec3f& D,
+      float* t,
+      float* b1,
+      float* b2) const;
+
+  }; // TriangleGroup
+
+  using NodeArray = std::vector<Node>;
   using TriangleIndexArray = std::vector<int>;
+  using TriangleGroupArray = std::vector<TriangleGroup>;
 
   Reference<TriangleMesh> _mesh;
   TriangleIndexArray _triangles;
-  Node* _root{};
-  int _nodeCount{};
-  int _maxTrisPerNode;
+  TriangleGroupArray _groups;
+  NodeArray _nodes;
+  WideNodeArray<4> _nodes4;
+  WideNodeArray<8> _nodes8;
+  QuantizedNodeArray<4, uint8_t> _nodes4q8;
+  QuantizedNodeArray<4, uint16_t> _nodes4q16;
+  QuantizedNodeArray<8, uint8_t> _nodes8q8;
+  QuantizedNodeArray<8, uint16_t> _nodes8q16;
+  BVHParams _params;
+  float _sahCost{};
+  float _builtSahCost{};
+  mutable BVHSpatialSplitStats _spatialSplitStats{};
+  uint32_t _meshVersion{};
+  uint32_t _revision{};
+  float _buildTime{};
+  bool _cached{};
+#ifdef BVH_RAY_COUNTERS
+  mutable std::atomic<uint64_t> _rayCount{};
+  mutable std::atomic<uint64_t> _nodesVisited{};
+  mutable std::atomic<uint64_t> _trianglesTested{};
+
+  class RayCounter;
+#endif // BVH_RAY_COUNTERS
 
   struct TriangleInfo;
+  struct Subtree;
+  struct BuildState;
 
   using TriangleInfoArray = std::vector<TriangleInfo>;
+  using MortonCodeArray = std::vector<uint64_t>;
 
-  Node* makeLeaf(TriangleInfoArray&,
+  void makeLeaf(Subtree&, TriangleInfoArray&, int start, int end);
+  void makeNode(Subtree&,
+    BuildState&,
     int start,
     int end,
-    TriangleIndexArray&);
+    int depth,
+    int worker);
+  void makeSpatialNode(Subtree&,
+    BuildState&,
+    TriangleInfoArray& refs,
+    int budget,
+    int depth,
+    int worker);
+  void splitReference(const TriangleInfo& ref,
+    int dim,
+    float position,
+    TriangleInfo& left,
+    TriangleInfo& right) const;
+  int maxReferenceCount() const;
+
+  void sortByMortonCodes(TriangleInfoArray&,
+    MortonCodeArray&,
+    ThreadPool*) const;
 
-  Node* makeNode(TriangleInfoArray&,
+  void flatten(const Subtree&);
+  void updateInteriorBounds();
+  void restructureTreelets(int passes);
+
+  int splitSAH(TriangleInfoArray&,
     int start,
     int end,
-    TriangleIndexArray&);
-	
-  
+    const Bounds3f& bounds,
+    const Bounds3f& centroidBounds,
+    int dim) const;
+
+  void build();
+  bool read(const char* filename);
+  float computeSAHCost() const;
+  void buildTriangleGroups(ThreadPool*);
+  void rebuild();
+  void buildWideNodes();
+  // Releases the binary nodes of a quantized tree, once built and
+  // cached. Rays then traverse the quantized nodes only: packets are
+  // traced ray by ray and refit() rebuilds the tree
+  void compact();
+
+  template <int N> void collapse(WideNodeArray<N>&) const;
+  template <int N>
+  void reorder(WideNodeArray<N>&, size_t nodeSize) const;
+  template <int N, typename Q>
+  void quantize(QuantizedNodeArray<N, Q>&) const;
+
+  bool intersect(const Node* node,
+    const Ray& ray,
+    Intersection& hit,
+    float d) const;
+  bool intersectLeaf(int first,
+    int count,
+    const Ray& ray,
+    Intersection& hit,
+    float d) const;
+  int occluderLeaf(int first, int count, const Ray& ray) const;
+
+  template <typename T>
+  bool intersect(const std::vector<T>& nodes,
+    const Ray& ray,
+    Intersection& hit,
+    float d) const;
+  template <typename T>
+  int occluder(const std::vector<T>& nodes, const Ray& ray) const;
 
 }; // BVH
 
@@ -0,0 +1,310 @@
+//[]---------------------------------------------------------------[]
+//|                                                                 |
+//| Copyright (C) 2019 Orthrus Group.                               |
+//|                                                                 |
+//| This software is provided 'as-is', without any express or       |
+//| implied warranty. In no event will the authors be held liable   |
+//| for any damages arising from the use of this software.          |
+//|                                                                 |
+//| Permission is granted to anyone to use this software for any    |
+//| purpose, including commercial applications, and to alter it and |
+//| redistribute it freely, subject to the following restrictions:  |
+//|                                                                 |
+//| 1. The origin of this software must not be misrepresented; you  |
+//| must not claim that you wrote the original software. If you use |
+//| this software in a product, an acknowledgment in the product    |
+//| documentation would be appreciated but is not required.         |
+//|                                                                 |
+//| 2. Altered source versions must be plainly marked as such, and  |
+//| must not be misrepresented as being the original software.      |
+//|                                                                 |
+//| 3. This notice may not be removed or altered from any source    |
+//| distribution.                                                   |
+//|                                                                 |
+//[]---------------------------------------------------------------[]
+//
+// OVERVIEW: BVHBenchmark.cpp
+// ========
+// Source file for BVH benchmark.
+//
+// Author(s): Paulo Pagliosa (and your name)
+// Last revision: 18/11/2019
+
+#include "BVHBenchmark.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdarg>
+#include <cstdio>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif // __linux__
+
+namespace cg
+{ // begin namespace cg
+
+namespace
+{ // begin namespace
+
+// Hardware cache counters of the calling thread
+class PerfCounters
+{
+public:
+  enum
+  {
+    CacheMisses,
+    L1Misses,
+    TLBMisses,
+    Count
+  };
+
+  PerfCounters();
+
+  ~PerfCounters();
+
+  void start();
+  void stop();
+
+  /// Returns the count of counter i since start(), or -1 if the counter
+  /// is not available.
+  long long value(int i) const
+  {
+    return _fd[i] < 0 ? -1 : _value[i];
+  }
+
+private:
+  int _fd[Count];
+  long long _value[Count]{};
+
+}; // PerfCounters
+
+PerfCounters::PerfCounters()
+{
+  std::fill(_fd, _fd + Count, -1);
+#ifdef __linux__
+  auto cache = [](int cache, int op, int result)
+  {
+    return uint64_t(cache) | uint64_t(op) << 8 | uint64_t(result) << 16;
+  };
+  const uint32_t types[Count]
+  {
+    PERF_TYPE_HARDWARE,
+    PERF_TYPE_HW_CACHE,
+    PERF_TYPE_HW_CACHE
+  };
+  const uint64_t configs[Count]
+  {
+    PERF_COUNT_HW_CACHE_MISSES,
+    cache(PERF_COUNT_HW_CACHE_L1D,
+      PERF_COUNT_HW_CACHE_OP_READ,
+      PERF_COUNT_HW_CACHE_RESULT_MISS),
+    cache(PERF_COUNT_HW_CACHE_DTLB,
+      PERF_COUNT_HW_CACHE_OP_READ,
+      PERF_COUNT_HW_CACHE_RESULT_MISS)
+  };
+
+  for (int i = 0; i < Count; ++i)
+  {
+    perf_event_attr attr{};
+
+    attr.size = sizeof attr;
+    attr.type = types[i];
+    attr.config = configs[i];
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    _fd[i] = int(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+  }
+#endif // __linux__
+}
+
+PerfCounters::~PerfCounters()
+{
+#ifdef __linux__
+  for (auto fd : _fd)
+    if (fd >= 0)
+      close(fd);
+#endif // __linux__
+}
+
+void
+PerfCounters::start()
+{
+#ifdef __linux__
+  for (auto fd : _fd)
+    if (fd >= 0)
+    {
+      ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+      ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif // __linux__
+}
+
+void
+PerfCounters::stop()
+{
+#ifdef __linux__
+  for (int i = 0; i < Count; ++i)
+    if (_fd[i] >= 0)
+    {
+      ioctl(_fd[i], PERF_EVENT_IOC_DISABLE, 0);
+      if (read(_fd[i], _value + i, sizeof _value[i]) != sizeof _value[i])
+        _value[i] = 0;
+    }
+#endif // __linux__
+}
+
+void
+appendf(std::string& s, const char* format, ...)
+{
+  char buffer[256];
+  va_list args;
+
+  va_start(args, format);
+  vsnprintf(buffer, sizeof buffer, format, args);
+  va_end(args);
+  s += buffer;
+}
+
+} // end namespace
+
+
+/////////////////////////////////////////////////////////////////////
+//
+// BVHBenchmark implementation
+// ============
+BVHBenchmark::BVHBenchmark(int numberOfRays, int repetitions):
+  _numberOfRays{std::max(numberOfRays, 1)},
+  _repetitions{std::max(repetitions, 1)}
+{
+  // do nothing
+}
+
+BVHBenchmark::Result
+BVHBenchmark::run(TriangleMesh& mesh, const BVHParams& params) const
+{
+  Reference<BVH> bvh = new BVH{mesh, params};
+  auto bounds = bvh->bounds();
+  auto center = bounds.center();
+  auto radius = bounds.maxSize() * 1.5f;
+  // Same rays for every tree of the mesh (LCG seeded with 1)
+  uint32_t seed = 1;
+  auto random = [&seed]()
+  {
+    seed = seed * 1664525u + 1013904223u;
+    return (seed >> 8) * (1.0f / 16777216);
+  };
+  std::vector<Ray> rays;
+
+  rays.reserve(_numberOfRays);
+  for (int i = 0; i < _numberOfRays; ++i)
+  {
+    vec3f d{random() - 0.5f, random() - 0.5f, random() - 0.5f};
+    auto o = center + d.versor() * radius;
+    auto p = bounds.min() + vec3f{random(), random(), random()} * bounds.size();
+
+    rays.emplace_back(o, p - o);
+  }
+
+  Result result{0, 0, -1, -1, -1};
+  PerfCounters counters;
+
+  for (int r = 0; r < _repetitions; ++r)
+  {
+    long long nodes = 0;
+
+    counters.start();
+
+    auto t = std::chrono::steady_clock::now();
+
+    for (const auto& ray : rays)
+    {
+      Intersection hit;
+
+      hit.object = nullptr;
+      hit.distance = math::Limits<float>::inf();
+      hit.nodesVisited = 0;
+      bvh->intersect(ray, hit, 1);
+      nodes += hit.nodesVisited;
+    }
+
+    std::chrono::duration<double> e{std::chrono::steady_clock::now() - t};
+
+    counters.stop();
+
+    auto raysPerSecond = _numberOfRays / e.count();
+
+    if (raysPerSecond <= result.raysPerSecond)
+      continue;
+    result.raysPerSecond = raysPerSecond;
+    result.nodesPerRay = double(nodes) / _numberOfRays;
+
+    double* misses[]{&result.cacheMisses, &result.l1Misses, &result.tlbMisses};
+
+    for (int i = 0; i < PerfCounters::Count; ++i)
+    {
+      auto n = counters.value(i);
+
+      *misses[i] = n < 0 ? -1 : double(n) / _numberOfRays;
+    }
+  }
+  return result;
+}
+
+void
+BVHBenchmark::compareLayouts(const char* name,
+  TriangleMesh& mesh,
+  std::string& report) const
+{
+  static const char* layoutNames[]{"depth-first", "van Emde Boas", "clustered"};
+  const BVHNodeLayout layouts[]
+  {
+    BVHNodeLayout::DepthFirst,
+    BVHNodeLayout::VanEmdeBoas,
+    BVHNodeLayout::Clustered
+  };
+  auto counted = false;
+
+  appendf(report,
+    "%s (%d triangles, %d rays)\n"
+    "  nodes  layout         Mrays/s  nodes/ray"
+    "  LLC miss/ray  L1D miss/ray  TLB miss/ray\n",
+    name,
+    mesh.data().numberOfTriangles,
+    _numberOfRays);
+  for (auto quantization : {0, 8})
+    for (int i = 0; i < 3; ++i)
+    {
+      BVHParams params;
+
+      params.splitMethod = BVHSplitMethod::SAH;
+      params.width = 4;
+      params.quantization = quantization;
+      params.layout = layouts[i];
+
+      auto r = run(mesh, params);
+
+      appendf(report,
+        "  %-5s  %-13s  %7.3f  %9.2f",
+        quantization ? "q8" : "float",
+        layoutNames[i],
+        r.raysPerSecond * 1e-6,
+        r.nodesPerRay);
+      for (auto m : {r.cacheMisses, r.l1Misses, r.tlbMisses})
+        if (m < 0)
+          appendf(report, "  %12s", "n/a");
+        else
+        {
+          appendf(report, "  %12.3f", m);
+          counted = true;
+        }
+      report += '\n';
+    }
+  if (!counted)
+    report += "  (no hardware cache counters: see BVHBenchmark.h)\n";
+}
+
+} // end namespace cg
@@ -0,0 +1,90 @@
+//[]---------------------------------------------------------------[]
+//|                                                                 |
+//| Copyright (C) 2019 Orthrus Group.                               |
+//|                                                                 |
+//| This software is provided 'as-is', without any express or       |
+//| implied warranty. In no event will the authors be held liable   |
+//| for any damages arising from the use of this software.          |
+//|                                                                 |
+//| Permission is granted to anyone to use this software for any    |
+//| purpose, including commercial applications, and to alter it and |
+//| redistribute it freely, subject to the following restrictions:  |
+//|                                                                 |
+//| 1. The origin of this software must not be misrepresented; you  |
+//| must not claim that you wrote the original software. If you use |
+//| this software in a product, an acknowledgment in the product    |
+//| documentation would be appreciated but is not required.         |
+//|                                                                 |
+//| 2. Altered source versions must be plainly marked as such, and  |
+//| must not be misrepresented as being the original software.      |
+//|                                                                 |
+//| 3. This notice may not be removed or altered from any source    |
+//| distribution.                                                   |
+//|                                                                 |
+//[]---------------------------------------------------------------[]
+//
+// OVERVIEW: BVHBenchmark.h
+// ========
+// Class definition for BVH benchmark.
+//
+// Author(s): Paulo Pagliosa (and your name)
+// Last revision: 18/11/2019
+
+#ifndef __BVHBenchmark_h
+#define __BVHBenchmark_h
+
+#include "BVH.h"
+#include <string>
+#include <vector>
+
+namespace cg
+{ // begin namespace cg
+
+
+/////////////////////////////////////////////////////////////////////
+//
+// BVHBenchmark: BVH benchmark class
+// ============
+// Traces incoherent rays, from points around a mesh to points inside
+// its bounds, through BVHs of the mesh. Cache and TLB misses are read
+// from hardware counters via perf_event_open() on Linux; they are
+// reported as unavailable elsewhere or if the kernel denies access.
+// Windows has no user-mode API for these counters: run the benchmark
+// under a profiler that samples them (e.g., VTune or Windows
+// Performance Recorder) to compare misses there.
+//
+class BVHBenchmark
+{
+public:
+  struct Result
+  {
+    double raysPerSecond;
+    double nodesPerRay;
+    // Misses per ray, negative if not available
+    double cacheMisses; // last level cache
+    double l1Misses; // L1 data cache reads
+    double tlbMisses; // data TLB reads
+
+  }; // Result
+
+  BVHBenchmark(int numberOfRays = 200000, int repetitions = 3);
+
+  /// Builds the BVH of mesh with params and traces the rays through it,
+  /// keeping the fastest repetition.
+  Result run(TriangleMesh& mesh, const BVHParams& params) const;
+
+  /// Appends to report the results of every node layout of the 4-wide
+  /// float and 8-bit quantized SAH BVHs of mesh.
+  void compareLayouts(const char* name,
+    TriangleMesh& mesh,
+    std::string& report) const;
+
+private:
+  int _numberOfRays;
+  int _repetitions;
+
+}; // BVHBenchmark
+
+} // end namespace cg
+
+#endif // __BVHBenchmark_h
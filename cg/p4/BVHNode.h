@@ -0,0 +1,101 @@
+//[]---------------------------------------------------------------[]
+//|                                                                 |
+//| Copyright (C) 2019 Orthrus Group.                               |
+//|                                                                 |
+//| This software is provided 'as-is', without any express or       |
+//| implied warranty. In no event will the authors be held liable   |
+//| for any damages arising from the use of this software.          |
+//|                                                                 |
+//| Permission is granted to anyone to use this software for any    |
+//| purpose, including commercial applications, and to alter it and |
+//| redistribute it freely, subject to the following restrictions:  |
+//|                                                                 |
+//| 1. The origin of this software must not be misrepresented; you  |
+//| must not claim that you wrote the original software. If you use |
+//| this software in a product, an acknowledgment in the product    |
+//| documentation would be appreciated but is not required.         |
+//|                                                                 |
+//| 2. Altered source versions must be plainly marked as such, and  |
+//| must not be misrepresented as being the original software.      |
+//|                                                                 |
+//| 3. This notice may not be removed or altered from any source    |
+//| distribution.                                                   |
+//|                                                                 |
+//[]---------------------------------------------------------------[]
+//
+//
+// OVERVIEW: BVHNode.h
+// ========
+// Class definition for binary BVH node.
+//
+// Author(s): Paulo Pagliosa (and your name)
+// Last revision: 18/11/2019
+
+#ifndef __BVHNode_h
+#define __BVHNode_h
+
+#include "geometry/Bounds3.h"
+#include <algorithm>
+#include <cstdint>
+
+namespace cg
+{ // begin namespace cg
+
+
+/////////////////////////////////////////////////////////////////////
+//
+// BVHNode: binary BVH node
+// =======
+// Node of the flat binary trees of BVH (over triangles) and SceneBVH
+// (over primitive instances). Nodes are stored in depth-first order:
+// the first child of an interior node follows it, and the second one
+// is referenced by index.
+//
+struct alignas(32) BVHNode
+{
+  Bounds3f bounds;
+  union
+  {
+    int first; // leaf: index of the first triangle or instance
+    int secondChild; // interior: index of the second child
+  };
+  uint16_t count; // number of triangles or instances, 0 for interior nodes
+  uint8_t axis; // split axis of an interior node
+  uint8_t pad;
+
+  bool isLeaf() const
+  {
+    return count > 0;
+  }
+
+}; // BVHNode
+
+/// Returns the axis of largest extent of b.
+inline int
+maxDim(const Bounds3f& b)
+{
+  auto s = b.size();
+  return s.x > s.y && s.x > s.z ? 0 : (s.y > s.z ? 1 : 2);
+}
+
+/// Partitions the items in [start,end) around their median along dim,
+/// as given by center(item), and returns the index of the median.
+template <typename T, typename Center>
+inline int
+medianSplit(T* items, int start, int end, int dim, Center center)
+{
+  auto mid = (start + end) / 2;
+
+  std::nth_element(items + start,
+    items + mid,
+    items + end,
+    [dim, &center](const T& a, const T& b)
+    {
+      return center(a)[dim] < center(b)[dim];
+    });
+  return mid;
+}
+
+} // end namespace cg
+
+#endif // __BVHNode_h
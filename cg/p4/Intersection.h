@@ -49,9 +49,13 @@ class TriangleShape;
 struct Intersection
 {
   const Primitive* object; // object intercepted by the ray
-  int triangleIndex; // index of the triangle intercepted by the ray
+  int triangleIndex; // index of the triangle intercepted by the ray (-1
+                    // if the object has a shape)
   float distance; // distance from the ray's origin to the intersection point
-  vec3f p; // barycentric coordinates of the intersection point
+  vec3f p; // barycentric coordinates of the intersection point, or its
+           // local position if the object has a shape (see Shape)
+  int nodesVisited; // number of BVH nodes visited by the ray
+  int instance; // index of the scene BVH instance intercepted by the ray
   void* userData; // any user data
 
 }; // Intersection
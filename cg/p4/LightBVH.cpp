@@ -0,0 +1,296 @@
+//[]---------------------------------------------------------------[]
+//|                                                                 |
+//| Copyright (C) 2019 Orthrus Group.                               |
+//|                                                                 |
+//| This software is provided 'as-is', without any express or       |
+//| implied warranty. In no event will the authors be held liable   |
+//| for any damages arising from the use of this software.          |
+//|                                                                 |
+//| Permission is granted to anyone to use this software for any    |
+//| purpose, including commercial applications, and to alter it and |
+//| redistribute it freely, subject to the following restrictions:  |
+//|                                                                 |
+//| 1. The origin of this software must not be misrepresented; you  |
+//| must not claim that you wrote the original software. If you use |
+//| this software in a product, an acknowledgment in the product    |
+//| documentation would be appreciated but is not required.         |
+//|                                                                 |
+//| 2. Altered source versions must be plainly marked as such, and  |
+//| must not be misrepresented as being the original software.      |
+//|                                                                 |
+//| 3. This notice may not be removed or altered from any source    |
+//| distribution.                                                   |
+//|                                                                 |
+//[]---------------------------------------------------------------[]
+//
+//
+// OVERVIEW: LightBVH.cpp
+// ========
+// Source file for light BVH.
+//
+// Author(s): Paulo Pagliosa (and your name)
+// Last revision: 18/11/2019
+
+#include "BVHNode.h"
+#include "LightBVH.h"
+#include <algorithm>
+#include <cmath>
+
+namespace cg
+{ // begin namespace cg
+
+namespace
+{ // begin namespace
+
+inline float
+angle(float c)
+{
+  return std::acos(math::clamp(c, -1.0f, 1.0f));
+}
+
+// Cone of the directions of a set of emission cones: every axis lies
+// within spread of axis, and every cone is emission wide
+inline void
+merge(vec3f& axis, float& spread, vec3f other, float otherSpread)
+{
+  // The wider cone is the one widened
+  if (otherSpread > spread)
+  {
+    std::swap(axis, other);
+    std::swap(spread, otherSpread);
+  }
+
+  auto pi = math::pi<float>();
+  auto c = axis.dot(other);
+  auto d = angle(c);
+
+  if (std::min(d + otherSpread, pi) <= spread)
+    return;
+
+  auto s = (spread + d + otherSpread) * 0.5f;
+
+  if (s >= pi)
+  {
+    spread = pi;
+    return;
+  }
+
+  // Rotate the axis towards the other one, in their plane
+  auto w = other - c * axis;
+  auto l = w.length();
+
+  if (l < 1e-6f)
+  {
+    spread = pi;
+    return;
+  }
+  axis = std::cos(s - spread) * axis + std::sin(s - spread) / l * w;
+  axis.normalize();
+  spread = s;
+}
+
+// Cosine and sine of max(theta - alpha, 0), for theta and alpha in
+// [0,pi]
+inline void
+subtract(float& c, float& s, float cosAlpha, float sinAlpha)
+{
+  if (c >= cosAlpha)
+  {
+    c = 1;
+    s = 0;
+  }
+  else
+  {
+    auto t = c * cosAlpha + s * sinAlpha;
+
+    s = s * cosAlpha - c * sinAlpha;
+    c = t;
+  }
+}
+
+} // end namespace
+
+
+/////////////////////////////////////////////////////////////////////
+//
+// LightBVH implementation
+// ========
+void
+LightBVH::build(const std::vector<Emitter>& emitters)
+{
+  _emitters.clear();
+  _nodes.clear();
+  for (const auto& e : emitters)
+    if (e.power > 0)
+      _emitters.push_back(e);
+
+  auto n = int(_emitters.size());
+
+  if (n > 0)
+  {
+    vec3f axis;
+    float spread, emission;
+
+    _nodes.reserve(2 * n - 1);
+    makeNode(0, n, axis, spread, emission);
+  }
+}
+
+void
+LightBVH::makeNode(int start,
+  int end,
+  vec3f& axis,
+  float& spread,
+  float& emission)
+{
+  auto index = int(_nodes.size());
+
+  _nodes.emplace_back();
+
+  Bounds3f bounds;
+  auto power = 0.0f;
+
+  for (int i = start; i < end; ++i)
+  {
+    bounds.inflate(_emitters[i].position);
+    power += _emitters[i].power;
+  }
+
+  auto emitter = -1;
+  auto secondChild = 0;
+
+  if (end - start == 1)
+  {
+    // Omni lights emit from a cone of axis spread pi around any axis
+    // and emission angle pi/2
+    const auto& e = _emitters[emitter = start];
+    auto omni = e.cosCutoff <= -1;
+
+    axis = e.direction;
+    spread = omni ? math::pi<float>() : 0;
+    emission = omni ? math::pi<float>() * 0.5f : angle(e.cosCutoff);
+  }
+  else
+  {
+    // Median split of the positions along the largest axis, as done
+    // by SceneBVH
+    auto mid = medianSplit(_emitters.data(),
+      start,
+      end,
+      maxDim(bounds),
+      [](const Emitter& e) { return e.position; });
+
+    vec3f a;
+    float sa, ea;
+
+    makeNode(start, mid, axis, spread, emission);
+    secondChild = int(_nodes.size());
+    makeNode(mid, end, a, sa, ea);
+    merge(axis, spread, a, sa);
+    emission = std::max(emission, ea);
+  }
+
+  auto& node = _nodes[index];
+
+  node.bounds = bounds;
+  node.axis = axis;
+  node.cosSpread = std::cos(spread);
+  node.sinSpread = std::sin(spread);
+  node.cosEmission = std::cos(emission);
+  node.power = power;
+  node.secondChild = secondChild;
+  node.emitter = emitter;
+}
+
+float
+LightBVH::importance(const Node& node, const vec3f& p, const vec3f& N) const
+//[]---------------------------------------------------[]
+//|  Importance of a node                               |
+//|  @param p shading point                             |
+//|  @param N unit normal at p                          |
+//|  @return bound of the light of the node at p        |
+//|                                                     |
+//|  The angles between the emitters and p, and between |
+//|  N and the emitters, are lower bounded by widening  |
+//|  them by the angle the bounding sphere of the node  |
+//|  subtends at p; zero is only returned if no emitter |
+//|  of the node can light p.                           |
+//[]---------------------------------------------------[]
+{
+  auto w = p - node.bounds.center();
+  auto d2 = w.squaredNorm();
+  auto r = node.bounds.diagonalLength() * 0.5f;
+  float cosU, sinU;
+
+  if (d2 <= r * r)
+  {
+    // p is inside the bounding sphere
+    cosU = -1;
+    sinU = 0;
+  }
+  else
+  {
+    sinU = r / std::sqrt(d2);
+    cosU = std::sqrt(1 - sinU * sinU);
+  }
+  w *= math::inverse(std::sqrt(std::max(d2, 1e-12f)));
+
+  // Emission: angle between the axis and the direction to p, less
+  // the spread of the node axes and the angle of the sphere
+  auto c = node.axis.dot(w);
+  auto s = std::sqrt(std::max(1 - c * c, 0.0f));
+
+  subtract(c, s, node.cosSpread, node.sinSpread);
+  subtract(c, s, cosU, sinU);
+  if (c <= node.cosEmission)
+    return 0;
+
+  // Incidence: angle between N and the direction to the node
+  auto ci = -N.dot(w);
+  auto si = std::sqrt(std::max(1 - ci * ci, 0.0f));
+
+  subtract(ci, si, cosU, sinU);
+  if (ci <= 0)
+    return 0;
+  return node.power * c * ci / std::max({d2, r * r, 1e-6f});
+}
+
+int
+LightBVH::sample(const vec3f& p, const vec3f& N, float u, float& pdf) const
+{
+  pdf = 1;
+  if (_nodes.empty())
+    return -1;
+
+  auto node = _nodes.data();
+
+  while (!node->isLeaf())
+  {
+    auto first = node + 1;
+    auto second = _nodes.data() + node->secondChild;
+    auto i1 = importance(*first, p, N);
+    auto i2 = importance(*second, p, N);
+
+    if (i1 + i2 <= 0)
+      return -1;
+
+    // Choose a child and rescale u to [0,1) for the next choice
+    auto p1 = i1 / (i1 + i2);
+
+    if (u < p1)
+    {
+      u /= p1;
+      pdf *= p1;
+      node = first;
+    }
+    else
+    {
+      u = std::min((u - p1) / (1 - p1), 0x1.fffffep-1f);
+      pdf *= 1 - p1;
+      node = second;
+    }
+  }
+  return _emitters[node->emitter].index;
+}
+
+} // end namespace cg
@@ -0,0 +1,118 @@
+//[]---------------------------------------------------------------[]
+//|                                                                 |
+//| Copyright (C) 2019 Orthrus Group.                               |
+//|                                                                 |
+//| This software is provided 'as-is', without any express or       |
+//| implied warranty. In no event will the authors be held liable   |
+//| for any damages arising from the use of this software.          |
+//|                                                                 |
+//| Permission is granted to anyone to use this software for any    |
+//| purpose, including commercial applications, and to alter it and |
+//| redistribute it freely, subject to the following restrictions:  |
+//|                                                                 |
+//| 1. The origin of this software must not be misrepresented; you  |
+//| must not claim that you wrote the original software. If you use |
+//| this software in a product, an acknowledgment in the product    |
+//| documentation would be appreciated but is not required.         |
+//|                                                                 |
+//| 2. Altered source versions must be plainly marked as such, and  |
+//| must not be misrepresented as being the original software.      |
+//|                                                                 |
+//| 3. This notice may not be removed or altered from any source    |
+//| distribution.                                                   |
+//|                                                                 |
+//[]---------------------------------------------------------------[]
+//
+//
+// OVERVIEW: LightBVH.h
+// ========
+// Class definition for light BVH.
+//
+// Author(s): Paulo Pagliosa (and your name)
+// Last revision: 18/11/2019
+
+#ifndef __LightBVH_h
+#define __LightBVH_h
+
+#include "core/SharedObject.h"
+#include "geometry/Bounds3.h"
+#include <vector>
+
+namespace cg
+{ // begin namespace cg
+
+
+/////////////////////////////////////////////////////////////////////
+//
+// LightBVH: bounding hierarchy of lights
+// ========
+// Binary tree over point and spot lights. Every node bounds the
+// positions, the total power and the emission cones of its lights.
+// sample() walks down the tree choosing each child with probability
+// proportional to a bound of the light its emitters may cast onto the
+// shading point, after Conty Estevez and Kulla, "Importance Sampling
+// of Many Lights with Adaptive Tree Splitting" (2018). Any emitter
+// able to light the point has a nonzero probability, so dividing its
+// contribution by the returned pdf yields an unbiased estimate of the
+// light of all emitters.
+//
+class LightBVH: public SharedObject
+{
+public:
+  struct Emitter
+  {
+    vec3f position;
+    vec3f direction; // spot axis
+    float cosCutoff; // cosine of the spot openning angle, -1 if omni
+    float power;
+    int index; // in the light table of the caller
+
+  }; // Emitter
+
+  auto size() const
+  {
+    return int(_emitters.size());
+  }
+
+  /// Rebuilds the tree. Emitters with no power are left out.
+  void build(const std::vector<Emitter>& emitters);
+
+  /// Samples an emitter for the point p with normal N, given a
+  /// uniform random number u in [0,1). Returns the index of the
+  /// emitter, or -1 if no emitter can light p, and its probability.
+  int sample(const vec3f& p, const vec3f& N, float u, float& pdf) const;
+
+private:
+  struct Node
+  {
+    Bounds3f bounds;
+    vec3f axis; // mean direction of the emission cones
+    float cosSpread; // cosine of the angle of the axes around axis
+    float sinSpread;
+    float cosEmission; // cosine of the largest emission angle
+    float power;
+    int secondChild; // interior nodes
+    int emitter; // leaves, -1 for interior nodes
+
+    bool isLeaf() const
+    {
+      return emitter >= 0;
+    }
+
+  }; // Node
+
+  std::vector<Emitter> _emitters;
+  std::vector<Node> _nodes;
+
+  void makeNode(int start,
+    int end,
+    vec3f& axis,
+    float& spread,
+    float& emission);
+  float importance(const Node& node, const vec3f& p, const vec3f& N) const;
+
+}; // LightBVH
+
+} // end namespace cg
+
+#endif // __LightBVH_h
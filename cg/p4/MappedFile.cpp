@@ -0,0 +1,121 @@
+//[]---------------------------------------------------------------[]
+//|                                                                 |
+//| Copyright (C) 2019 Orthrus Group.                               |
+//|                                                                 |
+//| This software is provided 'as-is', without any express or       |
+//| implied warranty. In no event will the authors be held liable   |
+//| for any damages arising from the use of this software.          |
+//|                                                                 |
+//| Permission is granted to anyone to use this software for any    |
+//| purpose, including commercial applications, and to alter it and |
+//| redistribute it freely, subject to the following restrictions:  |
+//|                                                                 |
+//| 1. The origin of this software must not be misrepresented; you  |
+//| must not claim that you wrote the original software. If you use |
+//| this software in a product, an acknowledgment in the product    |
+//| documentation would be appreciated but is not required.         |
+//|                                                                 |
+//| 2. Altered source versions must be plainly marked as such, and  |
+//| must not be misrepresented as being the original software.      |
+//|                                                                 |
+//| 3. This notice may not be removed or altered from any source    |
+//| distribution.                                                   |
+//|                                                                 |
+//[]---------------------------------------------------------------[]
+//
+// OVERVIEW: MappedFile.cpp
+// ========
+// Source file for read-only memory-mapped file.
+//
+// Author(s): Paulo Pagliosa (and your name)
+// Last revision: 18/11/2019
+
+#include "MappedFile.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif // _WIN32
+
+namespace cg
+{ // begin namespace cg
+
+
+/////////////////////////////////////////////////////////////////////
+//
+// MappedFile implementation
+// ==========
+MappedFile::MappedFile(const char* filename)
+{
+#ifdef _WIN32
+  auto file = CreateFileA(filename,
+    GENERIC_READ,
+    FILE_SHARE_READ,
+    nullptr,
+    OPEN_EXISTING,
+    FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN,
+    nullptr);
+
+  if (file == INVALID_HANDLE_VALUE)
+    return;
+
+  LARGE_INTEGER size;
+
+  if (GetFileSizeEx(file, &size) && size.QuadPart > 0)
+  {
+    // The view keeps the mapping alive after its handle is closed
+    auto mapping = CreateFileMappingA(file,
+      nullptr,
+      PAGE_READONLY,
+      0,
+      0,
+      nullptr);
+
+    if (mapping != nullptr)
+    {
+      if ((_data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0)) != nullptr)
+        _size = size_t(size.QuadPart);
+      CloseHandle(mapping);
+    }
+  }
+  CloseHandle(file);
+#else
+  auto fd = open(filename, O_RDONLY);
+
+  if (fd < 0)
+    return;
+
+  struct stat s;
+
+  if (fstat(fd, &s) == 0 && s.st_size > 0)
+  {
+    auto p = mmap(nullptr, size_t(s.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if (p != MAP_FAILED)
+    {
+      _data = p;
+      _size = size_t(s.st_size);
+    }
+  }
+  close(fd);
+#endif // _WIN32
+}
+
+MappedFile::~MappedFile()
+{
+  if (_data == nullptr)
+    return;
+#ifdef _WIN32
+  UnmapViewOfFile(_data);
+#else
+  munmap(const_cast<void*>(_data), _size);
+#endif // _WIN32
+}
+
+} // end namespace cg
@@ -0,0 +1,82 @@
+//[]---------------------------------------------------------------[]
+//|                                                                 |
+//| Copyright (C) 2019 Orthrus Group.                               |
+//|                                                                 |
+//| This software is provided 'as-is', without any express or       |
+//| implied warranty. In no event will the authors be held liable   |
+//| for any damages arising from the use of this software.          |
+//|                                                                 |
+//| Permission is granted to anyone to use this software for any    |
+//| purpose, including commercial applications, and to alter it and |
+//| redistribute it freely, subject to the following restrictions:  |
+//|                                                                 |
+//| 1. The origin of this software must not be misrepresented; you  |
+//| must not claim that you wrote the original software. If you use |
+//| this software in a product, an acknowledgment in the product    |
+//| documentation would be appreciated but is not required.         |
+//|                                                                 |
+//| 2. Altered source versions must be plainly marked as such, and  |
+//| must not be misrepresented as being the original software.      |
+//|                                                                 |
+//| 3. This notice may not be removed or altered from any source    |
+//| distribution.                                                   |
+//|                                                                 |
+//[]---------------------------------------------------------------[]
+//
+// OVERVIEW: MappedFile.h
+// ========
+// Class definition for read-only memory-mapped file.
+//
+// Author(s): Paulo Pagliosa (and your name)
+// Last revision: 18/11/2019
+
+#ifndef __MappedFile_h
+#define __MappedFile_h
+
+#include <cstddef>
+
+namespace cg
+{ // begin namespace cg
+
+
+/////////////////////////////////////////////////////////////////////
+//
+// MappedFile: read-only memory-mapped file class
+// ==========
+// Maps a whole file into memory with CreateFileMapping() on Windows
+// or mmap() elsewhere. The view is released on destruction.
+//
+class MappedFile
+{
+public:
+  MappedFile(const char* filename);
+
+  ~MappedFile();
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator =(const MappedFile&) = delete;
+
+  bool isOpen() const
+  {
+    return _data != nullptr;
+  }
+
+  const void* data() const
+  {
+    return _data;
+  }
+
+  size_t size() const
+  {
+    return _size;
+  }
+
+private:
+  const void* _data{};
+  size_t _size{};
+
+}; // MappedFile
+
+} // end namespace cg
+
+#endif // __MappedFile_h
@@ -1,8 +1,25 @@
 #include "geometry/MeshSweeper.h"
 #include "P4.h"
+#include "BVHBenchmark.h"
+#include <filesystem>
 
 MeshMap P4::_defaultMeshes;
 
+// Built BVHs are cached across launches in this directory
+inline const std::string&
+bvhCacheDirectory()
+{
+	static const auto dir = []()
+	{
+		std::error_code e;
+		auto temp = std::filesystem::temp_directory_path(e);
+
+		return (e ? std::filesystem::path{"."} : temp).append("cg-bvh").string();
+	}();
+
+	return dir;
+}
+
 inline auto
 normalize(const vec4f& p)
 {
@@ -49,10 +66,21 @@ P4::buildDefaultMeshes()
   _defaultMeshes["Sphere"] = GLGraphics3::sphere();
 }
 
+// The default meshes are traced as analytic shapes
+inline Shape*
+makeShape(const std::string& meshName)
+{
+  if (meshName == "Sphere")
+    return new Sphere;
+  if (meshName == "Box")
+    return new Box;
+  return nullptr;
+}
+
 inline Primitive*
 makePrimitive(MeshMapIterator mit)
 {
-  return new Primitive(mit->second, mit->first);
+  return new Primitive(mit->second, mit->first, makeShape(mit->first));
 }
 
 inline void
@@ -459,7 +487,7 @@ P4::inspectShape(Primitive& primitive)
     }
     for (auto mit = _defaultMeshes.begin(); mit != _defaultMeshes.end(); ++mit)
       if (ImGui::Selectable(mit->first.c_str()))
-        primitive.setMesh(mit->second, mit->first);
+        primitive.setMesh(mit->second, mit->first, makeShape(mit->first));
     ImGui::EndPopup();
   }
 }
@@ -483,6 +511,68 @@ P4::inspectPrimitive(Primitive& primitive)
     inspectShape(primitive);
   //if (ImGui::TreeNodeEx("Material", flag))
     inspectMaterial(primitive.material);
+  if (auto bvh = primitive.getBVH())
+    if (ImGui::TreeNode("BVH"))
+    {
+      inspectBVH(*bvh);
+      ImGui::TreePop();
+    }
+}
+
+inline void
+P4::inspectBVH(BVH& bvh)
+{
+  if (_statsBVH != &bvh || _statsRevision != bvh.revision())
+  {
+    _statsBVH = &bvh;
+    _statsRevision = bvh.revision();
+    _bvhStats = bvh.stats();
+  }
+#ifdef BVH_RAY_COUNTERS
+  else
+    bvh.readRayCounters(_bvhStats);
+#endif // BVH_RAY_COUNTERS
+
+  const auto& stats = _bvhStats;
+  const auto& params = bvh.params();
+  auto histogram = [](const char* label, const std::vector<int>& h)
+  {
+    std::vector<float> values(h.begin(), h.end());
+
+    ImGui::PlotHistogram(label,
+      values.data(),
+      int(values.size()),
+      0,
+      nullptr,
+      0,
+      FLT_MAX,
+      ImVec2{0, 60});
+  };
+
+  ImGui::Text("Nodes: %d (%d leaves)", stats.nodeCount, stats.leafCount);
+  ImGui::Text("Width: %d", params.width);
+  ImGui::Text("SAH cost: %g", stats.sahCost);
+  ImGui::Text("Memory: %.1f KB", stats.memoryBytes / 1024.0f);
+  if (bvh.isCached())
+    ImGui::Text("Build time: (loaded from cache)");
+  else
+    ImGui::Text("Build time: %.2f ms", stats.buildTime * 1000);
+  ImGui::Text("Max depth: %d", stats.maxDepth());
+  histogram("Nodes per depth", stats.depthHistogram);
+  histogram("Leaves per size", stats.leafSizeHistogram);
+  // Leaves the builder could not split are a sign of a bad tree
+  if (int(stats.leafSizeHistogram.size()) > params.maxTrisPerNode + 1)
+    ImGui::TextColored(ImVec4{1, 0.5f, 0, 1},
+      "Leaves with more than %d triangles",
+      params.maxTrisPerNode);
+#ifdef BVH_RAY_COUNTERS
+  ImGui::Separator();
+  ImGui::Text("Rays: %llu", (unsigned long long)stats.rayCount);
+  ImGui::Text("Nodes visited per ray: %.2f", stats.nodesVisitedPerRay());
+  ImGui::Text("Triangles tested per ray: %.2f", stats.trianglesTestedPerRay());
+  if (ImGui::Button("Reset Counters"))
+    bvh.resetRayCounters();
+#endif // BVH_RAY_COUNTERS
 }
 
 inline void
@@ -921,6 +1011,87 @@ P4::showOptions()
   ImGui::PopItemWidth();
 }
 
+void
+P4::benchmarkBVHLayouts()
+//[]---------------------------------------------------[]
+//|  Benchmark BVH layouts                              |
+//|                                                     |
+//|  Run the benchmark on every asset mesh in the       |
+//|  background. The meshes are read into private       |
+//|  copies, released after use, so neither the assets  |
+//|  nor the scene are touched by the benchmark thread. |
+//[]---------------------------------------------------[]
+{
+  _showBenchmark = true;
+  if (_benchmarking)
+    return;
+  cancelBenchmark();
+  _benchmarkReport.clear();
+
+  std::vector<std::string> names;
+
+  for (const auto& m : Assets::meshes())
+    names.push_back(m.first);
+  _benchmarking = true;
+  _benchmarkThread = std::thread{[this, names]()
+  {
+    BVHBenchmark benchmark;
+
+    for (const auto& name : names)
+    {
+      if (_benchmarkCanceled)
+        break;
+
+      std::string report;
+      Reference<TriangleMesh> mesh{Application::loadMesh(("meshes/" + name).c_str())};
+
+      if (mesh == nullptr)
+        report = name + ": cannot read mesh\n";
+      else
+        benchmark.compareLayouts(name.c_str(), *mesh, report);
+
+      std::lock_guard<std::mutex> lock{_benchmarkMutex};
+
+      _benchmarkReport += report;
+    }
+    _benchmarking = false;
+  }};
+}
+
+void
+P4::cancelBenchmark()
+{
+  if (!_benchmarkThread.joinable())
+    return;
+  _benchmarkCanceled = true;
+  _benchmarkThread.join();
+  _benchmarkCanceled = false;
+}
+
+inline void
+P4::benchmarkWindow()
+{
+  if (!_showBenchmark)
+    return;
+  ImGui::Begin("BVH Layout Benchmark", &_showBenchmark);
+  if (_benchmarking)
+    ImGui::Text("Running...");
+  else if (ImGui::Button("Run Again"))
+    benchmarkBVHLayouts();
+
+  std::lock_guard<std::mutex> lock{_benchmarkMutex};
+
+  ImGui::TextUnformatted(_benchmarkReport.c_str());
+  ImGui::End();
+}
+
+void
+P4::terminate()
+{
+  cancelBenchmark();
+  GLWindow::terminate();
+}
+
 inline void
 P4::mainMenu()
 {
@@ -964,6 +1135,8 @@ P4::mainMenu()
         showOptions();
         ImGui::EndMenu();
       }
+      if (ImGui::MenuItem("BVH Layout Benchmark"))
+        benchmarkBVHLayouts();
       ImGui::EndMenu();
     }
 		if (ImGui::BeginMenu("Scene Selector"))
@@ -1728,11 +1901,15 @@ P4::preview(int x, int y, int width, int height)
 void
 P4::gui()
 {
+  // Hold the background render while the GUI edits the scene; it is
+  // resumed (or restarted, if anything changed) by renderScene()
+  _rayTracer->pauseRender();
   mainMenu();
-  if (_viewMode == ViewMode::Renderer)
-    return;
   hierarchyWindow();
   inspectorWindow();
+  benchmarkWindow();
+  if (_viewMode == ViewMode::Renderer)
+    return;
   assetsWindow();
   editorView();
 }
@@ -1744,6 +1921,35 @@ drawMesh(GLMesh* mesh, GLuint mode)
   glDrawElements(GL_TRIANGLES, mesh->vertexCount(), GL_UNSIGNED_INT, 0);
 }
 
+void
+P4::buildBVH(Primitive& primitive)
+{
+	auto mesh = primitive.mesh();
+
+	if (mesh == nullptr)
+		return;
+	// the ray tracer intersects the shape instead
+	if (primitive.shape() != nullptr)
+	{
+		primitive.setBVH(nullptr);
+		return;
+	}
+
+	auto bvh = bvhMap[mesh];
+
+	if (bvh == nullptr)
+	{
+		BVHParams params;
+
+		params.splitMethod = BVHSplitMethod::SAH;
+		params.width = 4;
+		bvhMap[mesh] = bvh = new BVH{ *mesh, params, bvhCacheDirectory().c_str() };
+	}
+	
+	// stores a reference to the bvh related to the primitive
+	primitive.setBVH(bvh);
+}
+
 inline void
 P4::drawPrimitive(Primitive& primitive)
 {
@@ -1766,16 +1972,7 @@ P4::drawPrimitive(Primitive& primitive)
 
 	m->bind();
 	drawMesh(m, GL_FILL);
-	// **Begin BVH test
-	auto bvh = bvhMap[mesh];
-
-	if (bvh == nullptr)
-		bvhMap[mesh] = bvh = new BVH{ *mesh, 16 };
-	
-	// stores a reference to the bvh related to the primitive being drawn
-	primitive.setBVH(bvh);
-	
-	// **End BVH test
+	buildBVH(primitive);
 
 	if (primitive.sceneObject() != _current)
 		return;
@@ -2006,20 +2203,89 @@ P4::drawCamera(Camera& camera)
 	_editor->drawLine(p4, p8);
 }
 
+template <typename T>
+inline void
+addToSignature(std::vector<uint8_t>& signature, const T& value)
+{
+  auto p = (const uint8_t*)&value;
+
+  signature.insert(signature.end(), p, p + sizeof(T));
+}
+
+bool
+P4::updateRenderSignature(Camera& camera)
+{
+  // Raw bytes of everything the ray tracer reads from the scene. Any
+  // difference from the previous frame means the scene was edited
+  std::vector<uint8_t> s;
+
+  s.reserve(_renderSignature.size());
+  addToSignature(s, &camera);
+  addToSignature(s, camera.cameraToWorldMatrix());
+  addToSignature(s, camera.projectionMatrix());
+  addToSignature(s, camera.projectionType());
+  addToSignature(s, _scene->backgroundColor);
+  addToSignature(s, _scene->ambientLight);
+
+  auto it = _scene->getPrimitiveIter();
+  auto end = _scene->getPrimitiveEnd();
+
+  for (; it != end; it++)
+  {
+    auto component = (Component*)*it;
+    auto o = component->sceneObject();
+
+    addToSignature(s, component);
+    addToSignature(s, o->visible);
+    addToSignature(s, o->transform()->localToWorldMatrix());
+    if (auto p = dynamic_cast<Primitive*>(component))
+    {
+      // primitives added in the renderer view were never drawn
+      buildBVH(*p);
+      addToSignature(s, p->mesh());
+      // in-place edits of the vertices bump the mesh version
+      if (auto mesh = p->mesh())
+        addToSignature(s, mesh->version());
+      addToSignature(s, p->shape());
+      addToSignature(s, p->material);
+    }
+    else if (auto l = dynamic_cast<Light*>(component))
+    {
+      addToSignature(s, l->type());
+      addToSignature(s, l->color);
+      addToSignature(s, l->decayValue());
+      addToSignature(s, l->decayExponent());
+      addToSignature(s, l->openningAngle());
+    }
+  }
+  if (s == _renderSignature)
+    return false;
+  _renderSignature.swap(s);
+  return true;
+}
+
 inline void
 P4::renderScene()
 {
   if (auto camera = Camera::current())
   {
+    auto changed = updateRenderSignature(*camera);
+
     if (_image == nullptr)
     {
       const auto w = width(), h = height();
 
       _image = new GLImage{w, h};
       _rayTracer->setImageSize(w, h);
+      changed = true;
+    }
+    if (changed)
+    {
       _rayTracer->setCamera(camera);
-      _rayTracer->renderImage(*_image);
+      _rayTracer->startRender();
     }
+    _rayTracer->resumeRender();
+    _rayTracer->updateImage(*_image);
     _image->draw(0, 0);
   }
 }
@@ -2073,6 +2339,8 @@ P4::render()
 		renderScene();
 		return;
 	}
+	_rayTracer->cancelRender();
+	_image = nullptr;
 	if (_moveFlags)
 	{
 		const auto delta = _editor->orbitDistance() * CAMERA_RES;
@@ -2189,6 +2457,9 @@ P4::keyInputEvent(int key, int action, int mods)
 {
   auto active = action != GLFW_RELEASE && mods == GLFW_MOD_ALT;
 
+  // shortcuts below may edit the scene under the background render
+  _rayTracer->pauseRender();
+
 	if (key == GLFW_KEY_DELETE && action == GLFW_RELEASE)
 		removeCurrent();
 	else if (key == GLFW_KEY_E && action == GLFW_RELEASE && mods == GLFW_MOD_SHIFT)
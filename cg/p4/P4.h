@@ -11,6 +11,10 @@
 #include "core/Flags.h"
 #include "graphics/Application.h"
 #include "graphics/GLImage.h"
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
 #include <vector>
 
 using namespace cg;
@@ -32,6 +36,9 @@ public:
   /// Update the GUI.
   void gui() override;
 
+  /// Waits for the BVH layout benchmark, if running.
+  void terminate() override;
+
 	/// Render the scene.
 	void loadLights(GLSL::Program* program, Camera* cam);
 	void render() override;
@@ -94,16 +101,33 @@ private:
   Reference<RayTracer> _rayTracer;
   Reference<GLImage> _image;
 	BVHMap bvhMap;
+  std::vector<uint8_t> _renderSignature;
+  // Stats of the BVH shown in the inspector, recomputed only when the
+  // tree changes (the pointer is only compared, never dereferenced)
+  const BVH* _statsBVH{};
+  uint32_t _statsRevision{};
+  BVHStats _bvhStats{};
+  // BVH layout benchmark, run in the background
+  std::thread _benchmarkThread;
+  std::atomic<bool> _benchmarking{};
+  std::atomic<bool> _benchmarkCanceled{};
+  std::mutex _benchmarkMutex;
+  std::string _benchmarkReport;
+  bool _showBenchmark{};
 
   static MeshMap _defaultMeshes;
 
   void buildScene();
   void renderScene();
+  bool updateRenderSignature(Camera&);
 
 	void initOriginalScene();
   void mainMenu();
   void fileMenu();
   void showOptions();
+  void benchmarkBVHLayouts();
+  void cancelBenchmark();
+  void benchmarkWindow();
 
   void hierarchyWindow();
   void inspectorWindow();
@@ -124,12 +148,14 @@ private:
 	//void initRayScene3();
 	void preview(int, int, int, int);
   void inspectPrimitive(Primitive&);
+  void inspectBVH(BVH&);
   void inspectShape(Primitive&);
   void inspectMaterial(Material&);
   void inspectLight(Light&);
   void inspectCamera(Camera&);
   void addComponentButton(SceneObject&);
 
+  void buildBVH(Primitive&);
   void drawPrimitive(Primitive&);
   void drawLight(Light&);
   void drawCamera(Camera&);
@@ -54,7 +54,7 @@ Primitive::intersect(const Ray& ray, Intersection& hit) const
   float tMax;
 
   //localRay.direction *= d;
-  if (_mesh->bounds().intersect(localRay, tMin, tMax))
+  if (_mesh->bounds().intersect(RayPrecomputed{localRay}, tMin, tMax))
   {
     // TODO: mesh intersection
 		auto data = _mesh->data();
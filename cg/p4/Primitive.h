@@ -39,6 +39,7 @@
 #include "Material.h"
 #include "Intersection.h"
 #include "BVH.h"
+#include "Shape.h"
 
 namespace cg
 { // begin namespace cg
@@ -53,10 +54,15 @@ class Primitive: public Component
 public:
   Material material;
 
-  Primitive(TriangleMesh* mesh, const std::string& meshName):
+  /// Constructs a primitive drawn as mesh. If shape is not null, it is
+  /// the geometry intersected by the ray tracer instead of the mesh.
+  Primitive(TriangleMesh* mesh,
+    const std::string& meshName,
+    Shape* shape = nullptr):
     Component{"Primitive"},
     _mesh{mesh},
-    _meshName(meshName)
+    _meshName(meshName),
+    _shape{shape}
   {
     // do nothing
   }
@@ -71,10 +77,18 @@ public:
     return _meshName.c_str();
   }
 
-  void setMesh(TriangleMesh* mesh, const std::string& meshName)
+  void setMesh(TriangleMesh* mesh,
+    const std::string& meshName,
+    Shape* shape = nullptr)
   {
     _mesh = mesh;
     _meshName = meshName;
+    _shape = shape;
+  }
+
+  Shape* shape() const
+  {
+    return _shape;
   }
 
   BVH* getBVH()
@@ -94,6 +108,7 @@ private:
   Reference<TriangleMesh> _mesh;
   std::string _meshName;
   Reference<BVH> _BVH;
+  Reference<Shape> _shape;
 
 
 }; // Primitive
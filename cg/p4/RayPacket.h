@@ -0,0 +1,192 @@
+//[]---------------------------------------------------------------[]
+//|                                                                 |
+//| Copyright (C) 2019 Orthrus Group.                               |
+//|                                                                 |
+//| This software is provided 'as-is', without any express or       |
+//| implied warranty. In no event will the authors be held liable   |
+//| for any damages arising from the use of this software.          |
+//|                                                                 |
+//| Permission is granted to anyone to use this software for any    |
+//| purpose, including commercial applications, and to alter it and |
+//| redistribute it freely, subject to the following restrictions:  |
+//|                                                                 |
+//| 1. The origin of this software must not be misrepresented; you  |
+//| must not claim that you wrote the original software. If you use |
+//| this software in a product, an acknowledgment in the product    |
+//| documentation would be appreciated but is not required.         |
+//|                                                                 |
+//| 2. Altered source versions must be plainly marked as such, and  |
+//| must not be misrepresented as being the original software.      |
+//|                                                                 |
+//| 3. This notice may not be removed or altered from any source    |
+//| distribution.                                                   |
+//|                                                                 |
+//[]---------------------------------------------------------------[]
+//
+// OVERVIEW: RayPacket.h
+// ========
+// Class definition for ray packet.
+//
+// Author(s): Paulo Pagliosa (and your name)
+// Last revision: 18/11/2019
+
+#ifndef __RayPacket_h
+#define __RayPacket_h
+
+#include "geometry/Bounds3.h"
+#include "geometry/Ray.h"
+#include <cmath>
+
+namespace cg
+{ // begin namespace cg
+
+#define RAY_PACKET_SIZE 16 // 4x4 rays
+#define RAY_PACKET_MIN_ACTIVE 2 // fewer active rays are traced one by one
+
+
+/////////////////////////////////////////////////////////////////////
+//
+// RayPacket: packet of coherent rays class
+// =========
+// The rays of a packet are traced together through a BVH. Bounds of
+// their origins and inverse directions allow a whole packet to be
+// culled against a box by interval arithmetic with a single test.
+//
+struct RayPacket
+{
+  Ray rays[RAY_PACKET_SIZE];
+  float d[RAY_PACKET_SIZE]; // world length of a unit of ray parameter
+  int size{};
+
+  /// Computes the bounds of the rays selected by mask. The packet is
+  /// coherent if all of them have direction components of the same
+  /// (nonzero) signs, which BVH packet traversal requires.
+  void init(int mask)
+  {
+    const auto inf = math::Limits<float>::inf();
+
+    originMin = invMin = vec3f{+inf, +inf, +inf};
+    originMax = invMax = vec3f{-inf, -inf, -inf};
+    dMin = inf;
+    for (int k = 0; k < size; ++k)
+    {
+      if ((mask & (1 << k)) == 0)
+      {
+        // masked lanes are kept finite
+        for (int i = 0; i < 3; ++i)
+          origin[i][k] = 0, inverse[i][k] = 1;
+        continue;
+      }
+
+      const auto& ray = rays[k];
+
+      for (int i = 0; i < 3; ++i)
+      {
+        auto inv = math::inverse(ray.direction[i]);
+
+        origin[i][k] = ray.origin[i];
+        inverse[i][k] = inv;
+        originMin[i] = std::min(originMin[i], ray.origin[i]);
+        originMax[i] = std::max(originMax[i], ray.origin[i]);
+        invMin[i] = std::min(invMin[i], inv);
+        invMax[i] = std::max(invMax[i], inv);
+      }
+      dMin = std::min(dMin, d[k]);
+    }
+    coherent = true;
+    for (int i = 0; i < 3; ++i)
+    {
+      dirIsNeg[i] = invMax[i] < 0;
+      if (!std::isfinite(invMin[i]) || !std::isfinite(invMax[i]) ||
+        (invMin[i] < 0) != dirIsNeg[i])
+        coherent = false;
+    }
+  }
+
+  /// Returns true if no ray of the packet can hit the box closer than
+  /// distance. The test is conservative: each bound is computed from
+  /// the same floating-point operations as the ray/box test of a
+  /// single ray, so the bounds contain the value of every ray.
+  bool misses(const Bounds3f& bounds, float distance) const
+  {
+    auto tMin = -math::Limits<float>::inf();
+    auto tMax = +math::Limits<float>::inf();
+
+    for (int i = 0; i < 3; ++i)
+    {
+      auto p1 = bounds.min()[i];
+      auto p2 = bounds.max()[i];
+
+      if (dirIsNeg[i])
+        std::swap(p1, p2);
+
+      // entry parameter of the slab, lower bound
+      auto a = p1 - originMax[i];
+      auto b = p1 - originMin[i];
+
+      tMin = std::max(tMin,
+        std::min(std::min(a * invMin[i], a * invMax[i]),
+          std::min(b * invMin[i], b * invMax[i])));
+      // exit parameter of the slab, upper bound
+      a = p2 - originMax[i];
+      b = p2 - originMin[i];
+      tMax = std::min(tMax,
+        std::max(std::max(a * invMin[i], a * invMax[i]),
+          std::max(b * invMin[i], b * invMax[i])));
+    }
+    return tMin > tMax || tMax < 0 || tMin * dMin > distance;
+  }
+
+  /// Computes the parametric interval of every ray of a coherent
+  /// packet within the box, as Bounds3f::intersect() does for a
+  /// single ray; the box is missed by the rays where tMin > tMax.
+  /// Only the first size lanes are computed.
+  void intersect(const Bounds3f& bounds, float* tMin, float* tMax) const
+  {
+    for (int k = 0; k < size; ++k)
+    {
+      tMin[k] = -math::Limits<float>::inf();
+      tMax[k] = +math::Limits<float>::inf();
+    }
+    for (int i = 0; i < 3; ++i)
+    {
+      const auto p1 = bounds.min()[i];
+      const auto p2 = bounds.max()[i];
+
+      for (int k = 0; k < size; ++k)
+      {
+        auto t1 = (p1 - origin[i][k]) * inverse[i][k];
+        auto t2 = (p2 - origin[i][k]) * inverse[i][k];
+
+        tMin[k] = std::max(tMin[k], std::min(t1, t2));
+        tMax[k] = std::min(tMax[k], std::max(t1, t2));
+      }
+    }
+  }
+
+  bool isCoherent() const
+  {
+    return coherent;
+  }
+
+  bool isDirNeg(int axis) const
+  {
+    return dirIsNeg[axis];
+  }
+
+private:
+  alignas(64) float origin[3][RAY_PACKET_SIZE];
+  alignas(64) float inverse[3][RAY_PACKET_SIZE];
+  vec3f originMin;
+  vec3f originMax;
+  vec3f invMin;
+  vec3f invMax;
+  float dMin;
+  bool dirIsNeg[3];
+  bool coherent{};
+
+}; // RayPacket
+
+} // end namespace cg
+
+#endif // __RayPacket_h
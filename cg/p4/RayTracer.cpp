@@ -33,20 +33,35 @@
 #include "Camera.h"
 #include "RayTracer.h"
 #include "Light.h"
-#include <time.h>
+#include <chrono>
 
 using namespace std;
 
 namespace cg
 { // begin namespace cg
 
+using Clock = std::chrono::steady_clock;
+
 void
-printElapsedTime(const char* s, clock_t time)
+printElapsedTime(const char* s, Clock::duration time)
 {
-  printf("%sElapsed time: %.4f s\n", s, (float)time / CLOCKS_PER_SEC);
+  printf("%sElapsed time: %.4f s\n",
+    s,
+    std::chrono::duration<float>(time).count());
 }
 
 
+inline void
+adjustColor(Color& color)
+{
+  if (color.r > 1.0f)
+    color.r = 1.0f;
+  if (color.g > 1.0f)
+    color.g = 1.0f;
+  if (color.b > 1.0f)
+    color.b = 1.0f;
+}
+
 /////////////////////////////////////////////////////////////////////
 //
 // RayTracer implementation
@@ -56,7 +71,12 @@ RayTracer::RayTracer(Scene& scene, Camera* camera):
   _maxRecursionLevel{6},
   _minWeight{MIN_WEIGHT}
 {
-  // TODO: BVH
+  // do nothing
+}
+
+RayTracer::~RayTracer()
+{
+  cancelRender();
 }
 
 void
@@ -74,9 +94,8 @@ windowHeight(Camera* c)
 
 }
 void
-RayTracer::renderImage(Image& image)
+RayTracer::init()
 {
-  auto t = clock();
   const auto& m = _camera->cameraToWorldMatrix();
 
   // VRC axes
@@ -84,8 +103,6 @@ RayTracer::renderImage(Image& image)
   _vrc.v = m[1];
   _vrc.n = m[2];
   // init auxiliary mapping variables
-  _W = image.width();
-  _H = image.height();
   _Iw = math::inverse(float(_W));
   _Ih = math::inverse(float(_H));
 
@@ -97,16 +114,226 @@ RayTracer::renderImage(Image& image)
   _pixelRay.direction = -_vrc.n;
   _camera->clippingPlanes(_pixelRay.tMin, _pixelRay.tMax);
   _numberOfRays = _numberOfHits = 0;
-  scan(image);
+  _numberOfShadowRays = _numberOfNodeVisits = 0;
+  _numberOfOccluderTests = _numberOfOccluderHits = 0;
+  _numberOfSamples = 0;
+  _maxPixelSamples = 1;
+  if (_sceneBVH == nullptr || _sceneBVH->scene() != _scene)
+    _sceneBVH = new SceneBVH{*_scene};
+  _sceneBVH->update();
+  compile();
+
+  // init thread pool and per-thread contexts
+  auto n = _numberOfThreads > 0 ? _numberOfThreads : ThreadPool::defaultSize();
+
+  if (_threadPool == nullptr || _threadPool->size() != n)
+    _threadPool = new ThreadPool{n};
+  _contexts.assign(n, Context{});
+  for (auto& context : _contexts)
+  {
+    context.pixelRay = _pixelRay;
+    context.occluders.assign(_lights.size(), {});
+  }
+  if (_buffer.width() != _W || _buffer.height() != _H)
+    _buffer = ImageBuffer{_W, _H};
+  _objectIds.resize(size_t(_W) * _H);
+}
+
+void
+RayTracer::compile()
+//[]---------------------------------------------------[]
+//|  Compile the scene                                  |
+//|                                                     |
+//|  Snapshot the primitives of the scene BVH instances |
+//|  and the lights into flat arrays, along with the    |
+//|  camera position and the ambient and background     |
+//|  colors, so that shading never reads the (editable) |
+//|  scene.                                             |
+//[]---------------------------------------------------[]
+{
+  auto n = _sceneBVH->size();
+
+  _primitives.resize(n);
+  for (int i = 0; i < n; ++i)
+  {
+    auto p = _sceneBVH->primitive(i);
+    auto& info = _primitives[i];
+
+    info.normalMatrix = mat3f{p->transform()->worldToLocalMatrix()}.transposed();
+    info.material = p->material;
+    info.shape = p->shape();
+    info.vertexNormals = nullptr;
+    info.triangles = nullptr;
+    if (info.shape == nullptr)
+    {
+      const auto& data = p->mesh()->data();
+
+      info.vertexNormals = data.vertexNormals;
+      info.triangles = data.triangles;
+    }
+  }
+  _lights.clear();
+  for (auto it = _scene->getPrimitiveIter(); it != _scene->getPrimitiveEnd(); ++it)
+    if (auto l = dynamic_cast<Light*>((Component*)(*it)))
+    {
+      auto t = l->transform();
+      auto& info = _lights.emplace_back();
+
+      info.type = l->type();
+      info.color = l->color;
+      info.position = t->position();
+      info.direction = -t->up().versor();
+      info.cosCutoff = cos(math::toRadians(l->openningAngle()));
+      info.decayValue = l->decayValue();
+      info.decayExponent = l->decayExponent();
+    }
+
+  // Directional lights come first; the others are sampled by the
+  // light BVH, if any
+  auto directional = std::stable_partition(_lights.begin(),
+    _lights.end(),
+    [](const LightInfo& l) { return l.type == Light::Directional; });
+
+  _numberOfDirectionalLights = int(directional - _lights.begin());
+  if (_lightSamples > 0)
+  {
+    std::vector<LightBVH::Emitter> emitters;
+
+    for (auto i = _numberOfDirectionalLights; i < int(_lights.size()); ++i)
+    {
+      const auto& l = _lights[i];
+      auto& e = emitters.emplace_back();
+
+      e.position = l.position;
+      e.direction = l.direction;
+      e.cosCutoff = l.type == Light::Spot ? l.cosCutoff : -1;
+      e.power = std::max({l.color.r, l.color.g, l.color.b});
+      e.index = i;
+    }
+    if (_lightBVH == nullptr)
+      _lightBVH = new LightBVH;
+    _lightBVH->build(emitters);
+  }
+  _cameraPosition = _camera->transform()->position();
+  _ambientLight = _scene->ambientLight;
+  _backgroundColor = _scene->backgroundColor;
+}
+
+void
+RayTracer::printStatistics() const
+{
   printf("\nNumber of rays: %llu", _numberOfRays);
+  printf("\nNumber of shadow rays: %llu", _numberOfShadowRays);
   printf("\nNumber of hits: %llu", _numberOfHits);
-  printElapsedTime("\nDONE! ", clock() - t);
+  if (_numberOfRays > 0)
+    printf("\nBVH nodes visited per ray: %.2f",
+      double(_numberOfNodeVisits) / double(_numberOfRays));
+  if (_numberOfOccluderTests > 0)
+    printf("\nShadow occluder cache hits: %llu of %llu (%.1f%%)",
+      _numberOfOccluderHits,
+      _numberOfOccluderTests,
+      100.0 * double(_numberOfOccluderHits) / double(_numberOfOccluderTests));
+  if (_maxSamplingLevel > 0)
+  {
+    auto pixels = double(_W) * double(_H);
+    auto edges = uint64_t(std::count(_edges.begin(), _edges.end(), 1));
+
+    printf("\nSupersampled pixels: %llu (%.1f%%)",
+      edges,
+      100.0 * double(edges) / pixels);
+    printf("\nSamples per pixel: %.2f (max %d)",
+      1 + double(_numberOfSamples) / pixels,
+      _maxPixelSamples);
+  }
+}
+
+void
+RayTracer::renderImage(Image& image)
+{
+  auto t = Clock::now();
+
+  // A pause requested while no render was running must not hold the
+  // tiles of this synchronous render
+  cancelRender();
+  resumeRender();
+  _W = image.width();
+  _H = image.height();
+  init();
+  scan(image);
+  printStatistics();
+  printElapsedTime("\nDONE! ", Clock::now() - t);
+}
+
+void
+RayTracer::startRender()
+//[]---------------------------------------------------[]
+//|  Start progressive render                           |
+//|                                                     |
+//|  Set up the render on the calling thread and scan   |
+//|  the image in the background. Finished tiles are    |
+//|  queued to be published by updateImage().           |
+//[]---------------------------------------------------[]
+{
+  cancelRender();
+  init();
+  _rendering = true;
+  _renderThread = std::thread{&RayTracer::progressiveScan, this};
+}
+
+void
+RayTracer::cancelRender()
+{
+  if (!_renderThread.joinable())
+    return;
+  _canceled = true;
+  resumeRender();
+  _renderThread.join();
+  _canceled = false;
+  _rendering = false;
+  std::lock_guard<std::mutex> lock{_tileMutex};
+  _tiles.clear();
+}
+
+void
+RayTracer::pauseRender()
+{
+  if (!_rendering)
+    return;
+
+  std::unique_lock<std::mutex> lock{_gateMutex};
+
+  _paused = true;
+  _gateIdle.wait(lock, [this]() { return _busyTiles == 0; });
+}
+
+void
+RayTracer::resumeRender()
+{
+  {
+    std::lock_guard<std::mutex> lock{_gateMutex};
+    _paused = false;
+  }
+  _gateOpened.notify_all();
+}
+
+void
+RayTracer::updateImage(Image& image)
+{
+  std::vector<Tile> tiles;
+
+  {
+    std::lock_guard<std::mutex> lock{_tileMutex};
+    tiles.swap(_tiles);
+  }
+  for (const auto& tile : tiles)
+    image.setData(tile.x, tile.y, tile.data);
 }
 
 void
-RayTracer::setPixelRay(float x, float y)
+RayTracer::setPixelRay(Ray& pixelRay, float x, float y)
 //[]---------------------------------------------------[]
 //|  Set pixel ray                                      |
+//|  @param pixelRay ray to be set                      |
 //|  @param x coordinate of the pixel                   |
 //|  @param y cordinates of the pixel                   |
 //[]---------------------------------------------------[]
@@ -116,11 +343,11 @@ RayTracer::setPixelRay(float x, float y)
   switch (_camera->projectionType())
   {
     case Camera::Perspective:
-      _pixelRay.direction = (p - _camera->nearPlane() * _vrc.n).versor();
+      pixelRay.direction = (p - _camera->nearPlane() * _vrc.n).versor();
       break;
 
     case Camera::Parallel:
-      _pixelRay.origin = _camera->transform()->position() + p;
+      pixelRay.origin = _camera->transform()->position() + p;
       break;
   }
 }
@@ -128,62 +355,505 @@ RayTracer::setPixelRay(float x, float y)
 void
 RayTracer::scan(Image& image)
 {
-  ImageBuffer scanLine{_W, 1};
+  printf("Scanning %dx%d tiles with %d threads\n",
+    _tileSize,
+    _tileSize,
+    int(_contexts.size()));
+  scanPass(1, false);
+  if (_maxSamplingLevel > 0)
+    antialiasPass();
+  image.setData(0, 0, _buffer);
+}
 
-  for (int j = 0; j < _H; j++)
+void
+RayTracer::progressiveScan()
+{
+  auto t = Clock::now();
+
+  for (int step = MAX_PIXEL_STEP; step > 0 && !_canceled; step >>= 1)
+    scanPass(step, step < MAX_PIXEL_STEP);
+  if (!_canceled && _maxSamplingLevel > 0)
+    antialiasPass();
+  if (!_canceled)
+  {
+    printStatistics();
+    printElapsedTime("\nDONE! ", Clock::now() - t);
+  }
+  _rendering = false;
+}
+
+void
+RayTracer::scanPass(int step, bool refine)
+//[]---------------------------------------------------[]
+//|  Scan pass                                          |
+//|  @param step size of the pixel blocks of the pass   |
+//|  @param refine whether the pass refines a previous  |
+//|  pass of twice its step                             |
+//|                                                     |
+//|  Dispatch the tiles of the image to the thread      |
+//|  pool, wait for them and merge the counters of the  |
+//|  per-thread contexts.                               |
+//[]---------------------------------------------------[]
+{
+  // Each pixel only depends on its own coordinates, so the image does
+  // not depend on which thread renders which tile
+  for (int y = 0; y < _H; y += _tileSize)
+    for (int x = 0; x < _W; x += _tileSize)
+      _threadPool->submit([this, x, y, step, refine](int worker)
+      {
+        scanTile(_contexts[worker],
+          x,
+          y,
+          std::min(x + _tileSize, _W),
+          std::min(y + _tileSize, _H),
+          step,
+          refine);
+      });
+  _threadPool->wait();
+  mergeCounters();
+}
+
+void
+RayTracer::mergeCounters()
+{
+  for (auto& context : _contexts)
   {
-    auto y = (float)j + 0.5f;
+    _numberOfRays += context.numberOfRays;
+    _numberOfHits += context.numberOfHits;
+    _numberOfShadowRays += context.numberOfShadowRays;
+    _numberOfNodeVisits += context.numberOfNodeVisits;
+    _numberOfOccluderTests += context.numberOfOccluderTests;
+    _numberOfOccluderHits += context.numberOfOccluderHits;
+    _numberOfSamples += context.numberOfSamples;
+    _maxPixelSamples = std::max(_maxPixelSamples, context.maxPixelSamples);
+    context.numberOfRays = context.numberOfHits = 0;
+    context.numberOfShadowRays = context.numberOfNodeVisits = 0;
+    context.numberOfOccluderTests = context.numberOfOccluderHits = 0;
+    context.numberOfSamples = context.maxPixelSamples = 0;
+  }
+}
 
-    printf("Scanning line %d of %d\r", j + 1, _H);
+void
+RayTracer::antialiasPass()
+//[]---------------------------------------------------[]
+//|  Antialias pass                                     |
+//|                                                     |
+//|  Mark the pixels whose color contrasts with the one |
+//|  of a neighbour, or whose object differs, and       |
+//|  dispatch the tiles of the image to the thread pool |
+//|  to supersample the marked pixels.                  |
+//[]---------------------------------------------------[]
+{
+  // Pixels are marked before any of them is supersampled, so that the
+  // marks do not depend on the order the tiles are rendered
+  _edges.assign(size_t(_W) * _H, 0);
+  for (int j = 0; j < _H; j++)
     for (int i = 0; i < _W; i++)
-      scanLine[i] = shoot((float)i + 0.5f, y);
-    image.setData(0, j, scanLine);
+    {
+      auto k = j * _W + i;
+
+      if (i + 1 < _W && (_objectIds[k] != _objectIds[k + 1] ||
+        contrast(_buffer(i, j), _buffer(i + 1, j))))
+        _edges[k] = _edges[k + 1] = 1;
+      if (j + 1 < _H && (_objectIds[k] != _objectIds[k + _W] ||
+        contrast(_buffer(i, j), _buffer(i, j + 1))))
+        _edges[k] = _edges[k + _W] = 1;
+    }
+  for (int y = 0; y < _H; y += _tileSize)
+    for (int x = 0; x < _W; x += _tileSize)
+      _threadPool->submit([this, x, y](int worker)
+      {
+        antialiasTile(_contexts[worker],
+          x,
+          y,
+          std::min(x + _tileSize, _W),
+          std::min(y + _tileSize, _H));
+      });
+  _threadPool->wait();
+  mergeCounters();
+}
+
+void
+RayTracer::antialiasTile(Context& context, int x0, int y0, int x1, int y1)
+{
+  if (!enterTile())
+    return;
+
+  auto changed = false;
+
+  for (int j = y0; j < y1; j++)
+  {
+    if (!reenterTile())
+      return;
+    for (int i = x0; i < x1; i++)
+    {
+      if (_edges[j * _W + i] == 0)
+        continue;
+
+      // The first sample of the pixel is counted, though not used
+      auto samples = 1;
+
+      seed(context, i, j);
+      _buffer(i, j) = supersample(context, float(i), float(j), 1, 1, samples);
+      context.numberOfSamples += samples - 1;
+      context.maxPixelSamples = std::max(context.maxPixelSamples, samples);
+      changed = true;
+    }
+  }
+  leaveTile();
+  if (_rendering && changed)
+    publishTile(x0, y0, x1, y1);
+}
+
+inline bool
+RayTracer::contrast(const Color& a, const Color& b) const
+{
+  return std::max({std::abs(a.r - b.r),
+    std::abs(a.g - b.g),
+    std::abs(a.b - b.b)}) > _contrastThreshold;
+}
+
+inline bool
+RayTracer::contrast(const Pixel& a, const Pixel& b) const
+{
+  // Pixel components are bytes
+  return std::max({std::abs(a.r - b.r),
+    std::abs(a.g - b.g),
+    std::abs(a.b - b.b)}) > _contrastThreshold * 255;
+}
+
+Color
+RayTracer::supersample(Context& context,
+  float x,
+  float y,
+  float size,
+  int level,
+  int& samples)
+//[]---------------------------------------------------[]
+//|  Supersample a pixel region                         |
+//|  @param x coordinate of the region corner           |
+//|  @param y coordinate of the region corner           |
+//|  @param size side of the region                     |
+//|  @param level subdivision level of the region       |
+//|  @param samples number of samples taken (in/out)    |
+//|  @return mean color of the region                   |
+//|                                                     |
+//|  Shoot a ray through the center of each quadrant of |
+//|  the region, and subdivide the quadrants whose      |
+//|  color contrasts with, or whose object differs      |
+//|  from, the one of another quadrant.                 |
+//[]---------------------------------------------------[]
+{
+  auto h = size * 0.5f;
+  Color c[4];
+  int id[4];
+
+  for (int q = 0; q < 4; ++q)
+    c[q] = shoot(context,
+      x + (q & 1) * h + h * 0.5f,
+      y + (q >> 1) * h + h * 0.5f,
+      id[q]);
+  samples += 4;
+  if (level < _maxSamplingLevel)
+  {
+    bool split[4]{};
+
+    for (int q = 0; q < 4; ++q)
+      for (int r = q + 1; r < 4; ++r)
+        if (id[q] != id[r] || contrast(c[q], c[r]))
+          split[q] = split[r] = true;
+    for (int q = 0; q < 4; ++q)
+      if (split[q])
+        c[q] = supersample(context,
+          x + (q & 1) * h,
+          y + (q >> 1) * h,
+          h,
+          level + 1,
+          samples);
+  }
+  return (c[0] + c[1] + c[2] + c[3]) * 0.25f;
+}
+
+bool
+RayTracer::enterTile()
+//[]---------------------------------------------------[]
+//|  Enter tile                                         |
+//|  @return false if the render was canceled           |
+//|                                                     |
+//|  Wait while the render is paused and count the      |
+//|  calling task as busy, unless it was canceled.      |
+//[]---------------------------------------------------[]
+{
+  std::unique_lock<std::mutex> lock{_gateMutex};
+
+  _gateOpened.wait(lock, [this]() { return !_paused; });
+  if (_canceled)
+    return false;
+  ++_busyTiles;
+  return true;
+}
+
+bool
+RayTracer::reenterTile()
+//[]---------------------------------------------------[]
+//|  Reenter tile                                       |
+//|  @return false if the render was canceled           |
+//|                                                     |
+//|  Called between blocks of a tile: if the render was |
+//|  paused or canceled, leave the tile and enter it    |
+//|  again, so that pauseRender() does not wait for the |
+//|  whole tile.                                        |
+//[]---------------------------------------------------[]
+{
+  if (!_paused && !_canceled)
+    return true;
+  leaveTile();
+  return enterTile();
+}
+
+void
+RayTracer::leaveTile()
+{
+  std::lock_guard<std::mutex> lock{_gateMutex};
+
+  if (--_busyTiles == 0 && _paused)
+    _gateIdle.notify_all();
+}
+
+void
+RayTracer::scanTile(Context& context,
+  int x0,
+  int y0,
+  int x1,
+  int y1,
+  int step,
+  bool refine)
+//[]---------------------------------------------------[]
+//|  Scan tile                                          |
+//|  @param step size of the pixel blocks of the pass   |
+//|  @param refine whether to reuse previous samples    |
+//|                                                     |
+//|  Shoot one ray per step x step block of the tile    |
+//|  and fill the block with its color. When refining,  |
+//|  the samples taken by the previous (twice as        |
+//|  coarse) pass are reused, so the last pass yields   |
+//|  the same image as a single pass of step 1.         |
+//[]---------------------------------------------------[]
+{
+  if (!enterTile())
+    return;
+  // Pixels are shot in packets of blocks of packetSize x packetSize
+  // samples, or one by one if packet tracing is off
+  const auto blockSize = step * _packetSize;
+
+  for (int bj = y0; bj < y1; bj += blockSize)
+  {
+    auto bje = std::min(bj + blockSize, y1);
+
+    for (int bi = x0; bi < x1; bi += blockSize)
+    {
+      if (!reenterTile())
+        return;
+
+      auto bie = std::min(bi + blockSize, x1);
+      RayPacket packet;
+      int xs[RAY_PACKET_SIZE], ys[RAY_PACKET_SIZE];
+
+      for (int j = bj; j < bje; j += step)
+        for (int i = bi; i < bie; i += step)
+          if (!refine || ((i - x0) | (j - y0)) & step)
+          {
+            xs[packet.size] = i;
+            ys[packet.size++] = j;
+          }
+      if (packet.size == 1)
+      {
+        seed(context, xs[0], ys[0]);
+        _buffer(xs[0], ys[0]) = shoot(context,
+          xs[0] + 0.5f,
+          ys[0] + 0.5f,
+          _objectIds[ys[0] * _W + xs[0]]);
+      }
+      else if (packet.size > 1)
+      {
+        Color colors[RAY_PACKET_SIZE];
+        int ids[RAY_PACKET_SIZE];
+
+        for (int k = 0; k < packet.size; ++k)
+        {
+          packet.rays[k] = _pixelRay;
+          setPixelRay(packet.rays[k], xs[k] + 0.5f, ys[k] + 0.5f);
+          packet.d[k] = 1;
+        }
+        shoot(context, packet, xs, ys, colors, ids);
+        for (int k = 0; k < packet.size; ++k)
+        {
+          _buffer(xs[k], ys[k]) = colors[k];
+          _objectIds[ys[k] * _W + xs[k]] = ids[k];
+        }
+      }
+      if (step == 1)
+        continue;
+      for (int j = bj; j < bje; j += step)
+        for (int i = bi; i < bie; i += step)
+        {
+          const auto& pixel = _buffer(i, j);
+          auto xe = std::min(i + step, x1);
+          auto ye = std::min(j + step, y1);
+
+          for (int v = j; v < ye; v++)
+            for (int u = i; u < xe; u++)
+              _buffer(u, v) = pixel;
+        }
+    }
   }
+  leaveTile();
+  if (_rendering)
+    publishTile(x0, y0, x1, y1);
+}
+
+void
+RayTracer::publishTile(int x0, int y0, int x1, int y1)
+{
+  Tile tile{x0, y0, ImageBuffer{x1 - x0, y1 - y0}};
+
+  for (int j = y0; j < y1; j++)
+    for (int i = x0; i < x1; i++)
+      tile.data(i - x0, j - y0) = _buffer(i, j);
+
+  std::lock_guard<std::mutex> lock{_tileMutex};
+  _tiles.push_back(std::move(tile));
 }
 
 Color
-RayTracer::shoot(float x, float y)
+RayTracer::shoot(Context& context, float x, float y, int& id)
 //[]---------------------------------------------------[]
 //|  Shoot a pixel ray                                  |
 //|  @param x coordinate of the pixel                   |
 //|  @param y cordinates of the pixel                   |
+//|  @param id index of the object hit, or -1 (output)  |
 //|  @return RGB color of the pixel                     |
 //[]---------------------------------------------------[]
 {
   // set pixel ray
-  setPixelRay(x, y);
+  setPixelRay(context.pixelRay, x, y);
 
   // trace pixel ray
-  Color color = trace(_pixelRay, 0, 1.0f);
+  Color color = trace(context, context.pixelRay, 0, 1.0f, &id);
 
   // adjust RGB color
-  if (color.r > 1.0f)
-    color.r = 1.0f;
-  if (color.g > 1.0f)
-    color.g = 1.0f;
-  if (color.b > 1.0f)
-    color.b = 1.0f;
+  adjustColor(color);
   // return pixel color
   return color;
 }
 
+void
+RayTracer::shoot(Context& context,
+  RayPacket& packet,
+  const int* xs,
+  const int* ys,
+  Color* colors,
+  int* ids)
+//[]---------------------------------------------------[]
+//|  Shoot a packet of pixel rays                       |
+//|  @param packet pixel rays (in world space)          |
+//|  @param xs x coordinates of the pixels              |
+//|  @param ys y coordinates of the pixels              |
+//|  @param colors RGB colors of the pixels (output)    |
+//|  @param ids indices of the objects hit (output)     |
+//|                                                     |
+//|  Same as shooting the rays one by one, but with the |
+//|  closest hits of the packet found at once.          |
+//[]---------------------------------------------------[]
+{
+  Intersection hits[RAY_PACKET_SIZE];
+
+  for (int k = 0; k < packet.size; ++k)
+  {
+    hits[k].object = nullptr;
+    hits[k].distance = packet.rays[k].tMax;
+    hits[k].nodesVisited = 0;
+  }
+  packet.init((1 << packet.size) - 1);
+  _sceneBVH->intersect(packet, hits);
+  context.numberOfRays += packet.size;
+  for (int k = 0; k < packet.size; ++k)
+  {
+    auto& color = colors[k];
+
+    context.numberOfNodeVisits += hits[k].nodesVisited;
+    if (hits[k].object != nullptr)
+    {
+      context.numberOfHits++;
+      seed(context, xs[k], ys[k]);
+      color = shade(context, packet.rays[k], hits[k], 0, 1.0f);
+      ids[k] = hits[k].instance;
+    }
+    else
+    {
+      color = background();
+      ids[k] = -1;
+    }
+    adjustColor(color);
+  }
+}
+
+inline uint32_t
+pcgHash(uint32_t v)
+{
+  auto state = v * 747796405u + 2891336453u;
+  auto word = ((state >> ((state >> 28) + 4)) ^ state) * 277803737u;
+
+  return (word >> 22) ^ word;
+}
+
+inline void
+RayTracer::seed(Context& context, int x, int y) const
+{
+  // Pixels draw the same numbers whichever thread shoots them
+  context.seed = pcgHash(uint32_t(y * _W + x));
+}
+
+inline float
+RayTracer::random(Context& context) const
+//[]---------------------------------------------------[]
+//|  Random number                                      |
+//|  @return uniform random number in [0,1)             |
+//[]---------------------------------------------------[]
+{
+  context.seed = pcgHash(context.seed);
+  return (context.seed >> 8) * 0x1p-24f;
+}
+
 Color
-RayTracer::trace(const Ray& ray, uint32_t level, float weight)
+RayTracer::trace(Context& context,
+  const Ray& ray,
+  uint32_t level,
+  float weight,
+  int* id)
 //[]---------------------------------------------------[]
 //|  Trace a ray                                        |
 //|  @param the ray                                     |
 //|  @param recursion level                             |
 //|  @param ray weight                                  |
+//|  @param id index of the object hit, or -1 (output,  |
+//|  optional)                                          |
 //|  @return color of the ray                           |
 //[]---------------------------------------------------[]
 {
+  if (id != nullptr)
+    *id = -1;
   if (level > _maxRecursionLevel)
     return Color::black;
-  _numberOfRays++;
+  context.numberOfRays++;
 
   Intersection hit;
 
-  return intersect(ray, hit) ? shade(ray, hit, level, weight) : background();
+  if (!intersect(context, ray, hit))
+    return background();
+  if (id != nullptr)
+    *id = hit.instance;
+  return shade(context, ray, hit, level, weight);
 }
 
 inline constexpr auto
@@ -193,7 +863,7 @@ rt_eps()
 }
 
 bool
-RayTracer::intersect(const Ray& ray, Intersection& hit)
+RayTracer::intersect(Context& context, const Ray& ray, Intersection& hit)
 //[]---------------------------------------------------[]
 //|  Ray/object intersection                            |
 //|  @param the ray (input)                             |
@@ -203,104 +873,144 @@ RayTracer::intersect(const Ray& ray, Intersection& hit)
 {
   hit.object = nullptr;
   hit.distance = ray.tMax;
-  // TODO: insert your code here
-	float minDistance = math::Limits<float>::inf();
+  hit.nodesVisited = 0;
+  if (_sceneBVH->intersect(ray, hit))
+    context.numberOfHits++;
+  context.numberOfNodeVisits += hit.nodesVisited;
+  return hit.object != nullptr;
+}
+
+inline float
+powi(float x, int n)
+//[]---------------------------------------------------[]
+//|  Integer power                                      |
+//|  @return x^n, with the usual light decays (n <= 2)  |
+//|  specialized                                        |
+//[]---------------------------------------------------[]
+{
+  switch (n)
+  {
+    case 0:
+      return 1;
+    case 1:
+      return x;
+    case 2:
+      return x * x;
+  }
+
+  auto r = 1.0f;
+
+  for (; n > 0; n >>= 1, x *= x)
+    if (n & 1)
+      r *= x;
+  return r;
+}
 
-	auto it = _scene->getPrimitiveIter();
-	auto end = _scene->getPrimitiveEnd();
-	
-	for (; it != end; it++)
+inline Color
+RayTracer::directLight(Context& context,
+  int light,
+  const Material& material,
+  const vec3f& N,
+  const vec3f& p,
+  const vec3f& V)
+//[]---------------------------------------------------[]
+//|  Direct light                                       |
+//|  @return diffuse and specular color of the light at |
+//|  the point p                                        |
+//[]---------------------------------------------------[]
+{
+	const auto& l = _lights[light];
+	vec3f L;
+	auto d = math::Limits<float>::inf();
+
+	if (l.type == Light::Directional)
+		L = l.direction;
+	else
 	{
-		if (auto p = dynamic_cast<Primitive*>((Component*)(*it)))
-		{
-			if (!p->sceneObject()->visible)
-				continue;
-
-			auto t = p->transform();
-			auto o = t->worldToLocalMatrix().transform(ray.origin);
-			auto D = t->worldToLocalMatrix().transformVector(ray.direction);
-			auto d = math::inverse(D.length()); // ||s||
-
-			if (p->getBVH()->intersect({o, D}, hit, d))
-			{
-				_numberOfHits++;
-				if (hit.distance < minDistance)
-				{
-					hit.object = p;
-					minDistance = hit.distance;
-				}
-			}
-		}
+		L = p - l.position;
+		d = L.length();
+		L *= math::inverse(d);
 	}
-  return hit.object != nullptr;
+
+	// lights behind the surface contribute nothing, so no shadow
+	// ray is cast for them
+	auto NL = -N.dot(L);
+
+	if (NL <= 0.0f)
+		return Color::black;
+
+	Color IL;
+
+	switch (l.type)
+	{
+	case Light::Directional:
+		IL = l.color;
+		break;
+
+	case Light::Point:
+		IL = l.color * math::inverse(powi(d, l.decayValue));
+		break;
+
+	case Light::Spot:
+		auto cosAngle = l.direction.dot(L);
+
+		// neither do points out of the spot cone
+		if (cosAngle <= l.cosCutoff)
+			return Color::black;
+		IL = l.color * (powi(std::max(cosAngle, 0.0f), l.decayExponent) * math::inverse(powi(d, l.decayValue)));
+		break;
+	}
+
+	Ray r = l.type == Light::Directional ? Ray{ p, -L } : Ray{ p, -L, 0.0f, d };
+	if (shadow(context, r, light))
+		return Color::black;
+
+	auto R = (reflect(L, N)).versor();
+
+	auto ODIL = material.diffuse * IL;
+	auto OSIL = material.spot * IL;
+
+	auto firstTemp = ODIL * NL;
+	auto secTemp = OSIL * pow(std::max(R.dot(V), 0.0f), material.shine);
+	return firstTemp + secTemp;
 }
 
 inline Color
-RayTracer::directLight(const Ray& ray, Intersection& hit, vec3f& N, vec3f& p, vec3f& V)
+RayTracer::directLight(Context& context,
+  const Ray& ray,
+  Intersection& hit,
+  vec3f& N,
+  vec3f& p,
+  vec3f& V)
 {
-	//vec3f L{ 0.0f };
-	Color IL = Color::black;
-	auto material = hit.object->material;
-	auto ambientLight = _scene->ambientLight;
-	auto A = ambientLight; //IA
+	const auto& material = _primitives[hit.instance].material;
+	auto A = _ambientLight; //IA
 	auto OAIA = material.ambient * A;
 	auto c = OAIA;
-	float pw;
-	auto prim = hit.object;
-	vec3f L;
 
-	//tacertoateaqui
-	auto it = _scene->getPrimitiveIter();
-	auto end = _scene->getPrimitiveEnd();
-	for (; it != end; it++)
+	if (_lightSamples == 0)
 	{
-		if (auto l = dynamic_cast<Light*>((Component*)(*it)))
-		{
-			auto LPosition = l->sceneObject()->transform()->position(); 
-			auto LDirection = -(l->sceneObject()->transform()->up().versor());
-
-			L = l->type() == Light::Type::Directional ? LDirection : (p - LPosition);
-			auto d = L.length();
-			L = L.versor();
-
-			Ray r = l->type() == Light::Type::Directional ? Ray{ p, -L } : Ray{ p, -L, 0.0f, d };
-			if (!shadow(r))
-			{
-				switch (l->type())
-				{
-				case (0): //directional
-					IL = l->color;
-					break;
-
-				case (1): //point 
-					pw = (pow(d, l->decayValue()));
-					IL = l->color * math::inverse(pw);
-					break;
-
-				case (2): //spot
-					float angle = acos(LDirection.dot(L));
-					pw = (pow(d, l->decayValue()));
-					IL = (angle < math::toRadians(l->openningAngle())) ? l->color * (1/pw) * pow(std::max(cos(angle), 0.0f), l->decayExponent()) : Color::black;
-
-					break;
-				}
-			}
-			auto R = (reflect(L, N)).versor();
-
-			//auto ODIL = elementWise({ material.diffuse.r,material.diffuse.g,material.diffuse.b,material.diffuse.a }, IL);
-			//auto OSIL = elementWise({ material.spot.r,material.spot.g,material.spot.b,material.spot.a }, IL);
-
-			auto ODIL = material.diffuse * IL;
-			auto OSIL = material.spot * IL;
-
-			auto firstTemp = ODIL * std::max(N.dot(-L),0.0f);
-			auto secTemp = OSIL * pow(std::max(R.dot(V), 0.0f), material.shine);
-			//firstTemp = elementWise(ODIL, max(dot(N, L), float(flatMode)); 
-			//firstTemp = elementWise(OSIL, max(dot(N, L), float(flatMode) - 1);
-			c += firstTemp + secTemp;
-		}
+		for (int i = 0; i < int(_lights.size()); ++i)
+			c += directLight(context, i, material, N, p, V);
+		return c;
 	}
-	return c;
+	for (int i = 0; i < _numberOfDirectionalLights; ++i)
+		c += directLight(context, i, material, N, p, V);
+
+	// the light of the other lights is estimated from a few of them,
+	// drawn by importance: dividing the light of each sample by its
+	// probability keeps the estimate unbiased
+	auto S = Color::black;
+
+	for (int i = 0; i < _lightSamples; ++i)
+	{
+		float pdf;
+		auto k = _lightBVH->sample(p, N, random(context), pdf);
+
+		if (k >= 0)
+			S += directLight(context, k, material, N, p, V) * math::inverse(pdf);
+	}
+	return c + S * math::inverse(float(_lightSamples));
 }
 
 inline vec3f
@@ -310,7 +1020,11 @@ RayTracer::reflect(vec3f l, vec3f n)
 }
 
 Color
-RayTracer::shade(const Ray& ray, Intersection& hit, int level, float weight)
+RayTracer::shade(Context& context,
+  const Ray& ray,
+  Intersection& hit,
+  int level,
+  float weight)
 //[]---------------------------------------------------[]
 //|  Shade a point P                                    |
 //|  @param the ray (input)                             |
@@ -321,14 +1035,23 @@ RayTracer::shade(const Ray& ray, Intersection& hit, int level, float weight)
 //[]---------------------------------------------------[]
 {
   // TODO: insert your code here
-	auto normalMatrix = mat3f{ hit.object->sceneObject()->transform()->worldToLocalMatrix() }.transposed();
+	const auto& info = _primitives[hit.instance];
+
+	vec3f N;
 
-	auto data = hit.object->mesh()->data();
-	auto N = data.vertexNormals[data.triangles[hit.triangleIndex].v[0]] * hit.p.x
-		+ data.vertexNormals[data.triangles[hit.triangleIndex].v[1]] * hit.p.y
-		+ data.vertexNormals[data.triangles[hit.triangleIndex].v[2]] * hit.p.z;
+	// analytic shapes have exact normals
+	if (auto shape = info.shape)
+		N = shape->normal(hit);
+	else
+	{
+		const auto& v = info.triangles[hit.triangleIndex].v;
+
+		N = info.vertexNormals[v[0]] * hit.p.x
+			+ info.vertexNormals[v[1]] * hit.p.y
+			+ info.vertexNormals[v[2]] * hit.p.z;
+	}
 
-	N = (normalMatrix * N).normalize();
+	N = (info.normalMatrix * N).normalize();
 
 	auto p = ray.origin + hit.distance * ray.direction;
 	p += rt_eps() * N;
@@ -336,10 +1059,10 @@ RayTracer::shade(const Ray& ray, Intersection& hit, int level, float weight)
 	if (N.dot(ray.direction) > 0.0f)
 		N = -N;
 
-	auto V = (Camera::current()->transform()->position() - p).versor();
+	auto V = (_cameraPosition - p).versor();
 
-	auto c = directLight(ray,hit, N, p, V);
-	auto Or = hit.object->material.specular;
+	auto c = directLight(context, ray, hit, N, p, V);
+	auto Or = info.material.specular;
 
 	if (Or != Color::black)
 	{
@@ -347,8 +1070,8 @@ RayTracer::shade(const Ray& ray, Intersection& hit, int level, float weight)
 		if (w > _minWeight)
 		{
 			auto R = reflect(ray.direction,N);
-			auto sec = trace({ p,R }, level + 1, w);
-			if(sec != _scene->backgroundColor)
+			auto sec = trace(context, { p,R }, level + 1, w);
+			if(sec != _backgroundColor)
 				c += Or * sec;
 		}
 	}
@@ -362,19 +1085,37 @@ RayTracer::background() const
 //|  @return background color                           |
 //[]---------------------------------------------------[]
 {
-  return _scene->backgroundColor;
+  return _backgroundColor;
 }
 
 bool
-RayTracer::shadow(const Ray& ray)
+RayTracer::shadow(Context& context, const Ray& ray, int light)
 //[]---------------------------------------------------[]
 //|  Verifiy if ray is a shadow ray                     |
 //|  @param the ray (input)                             |
+//|  @param light index of the light the ray is cast to |
 //|  @return true if the ray intersects an object       |
+//|                                                     |
+//|  The shadow rays of a thread to a light are mostly  |
+//|  cast from neighbouring points, and blocked by the  |
+//|  same triangle: the last occluder found is tested   |
+//|  before traversing the scene BVH.                   |
 //[]---------------------------------------------------[]
 {
-  Intersection hit;
-  return intersect(ray, hit);
+  context.numberOfShadowRays++;
+
+  auto& occluder = context.occluders[light];
+
+  if (occluder.instance >= 0)
+  {
+    context.numberOfOccluderTests++;
+    if (_sceneBVH->occludedBy(occluder, ray))
+    {
+      context.numberOfOccluderHits++;
+      return true;
+    }
+  }
+  return _sceneBVH->occluded(ray, occluder);
 }
 
 } // end namespace cg
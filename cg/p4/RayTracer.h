@@ -35,13 +35,25 @@
 
 #include "graphics/Image.h"
 #include "Intersection.h"
+#include "Light.h"
+#include "LightBVH.h"
 #include "Renderer.h"
+#include "SceneBVH.h"
+#include "ThreadPool.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 
 namespace cg
 { // begin namespace cg
 
 #define MIN_WEIGHT float(0.001)
 #define MAX_RECURSION_LEVEL uint32_t(20)
+#define MAX_PIXEL_STEP 8 // pixel block size of the first progressive pass
+#define MAX_SAMPLING_LEVEL 4 // up to 4^4 samples per pixel
+#define DEFAULT_CONTRAST_THRESHOLD float(0.1)
 
 
 /////////////////////////////////////////////////////////////////////
@@ -54,6 +66,9 @@ public:
   // Constructor
   RayTracer(Scene&, Camera* = nullptr);
 
+  // Destructor
+  ~RayTracer() override;
+
   auto maxRecursionLevel() const
   {
     return _maxRecursionLevel;
@@ -74,9 +89,113 @@ public:
     _minWeight = std::max(w, MIN_WEIGHT);
   }
 
+  /// Returns the number of rendering threads (0 means one per core).
+  auto numberOfThreads() const
+  {
+    return _numberOfThreads;
+  }
+
+  auto tileSize() const
+  {
+    return _tileSize;
+  }
+
+  /// Returns the side of the blocks of primary rays traced as packets
+  /// (1 means no packets).
+  auto packetSize() const
+  {
+    return _packetSize;
+  }
+
+  /// Returns the number of lights sampled per shading point (0 means
+  /// every light is evaluated).
+  auto lightSamples() const
+  {
+    return _lightSamples;
+  }
+
+  /// Returns the maximum subdivision level of adaptive supersampling
+  /// (0 means one sample per pixel).
+  auto maxSamplingLevel() const
+  {
+    return _maxSamplingLevel;
+  }
+
+  auto contrastThreshold() const
+  {
+    return _contrastThreshold;
+  }
+
+  void setNumberOfThreads(int n)
+  {
+    _numberOfThreads = std::max(n, 0);
+  }
+
+  void setTileSize(int s)
+  {
+    _tileSize = std::max(s, 1);
+  }
+
+  /// Sets the packet size: 1 (no packets), 2 (2x2) or 4 (4x4 rays).
+  /// Packets are off by default: their lanes are not vectorized and
+  /// they did not measure faster than single rays on the test scenes.
+  void setPacketSize(int s)
+  {
+    _packetSize = s >= 4 ? 4 : s >= 2 ? 2 : 1;
+  }
+
+  /// Sets the number of point and spot lights sampled by importance
+  /// at every shading point, instead of evaluating all of them (see
+  /// LightBVH). Directional lights are always evaluated. 0 turns
+  /// sampling off.
+  void setLightSamples(int n)
+  {
+    _lightSamples = std::max(n, 0);
+  }
+
+  /// Sets the maximum subdivision level of adaptive supersampling.
+  /// After the image is scanned with one sample per pixel, the pixels
+  /// whose color contrasts with the one of a neighbour, or whose
+  /// object differs, are split into 4 quadrants sampled at their
+  /// centers; quadrants that differ are split again, up to the given
+  /// level. 0 turns supersampling off.
+  void setMaxSamplingLevel(int level)
+  {
+    _maxSamplingLevel = std::clamp(level, 0, MAX_SAMPLING_LEVEL);
+  }
+
+  /// Sets the largest difference of a color component between two
+  /// samples not considered a contrast.
+  void setContrastThreshold(float t)
+  {
+    _contrastThreshold = std::max(t, 0.0f);
+  }
+
   void render();
   virtual void renderImage(Image&);
 
+  /// Starts rendering an image of the current size in the background.
+  /// The image is refined in passes, from blocks of MAX_PIXEL_STEP
+  /// pixels down to one ray per pixel; any running render is canceled.
+  void startRender();
+
+  /// Cancels the background render and waits for its tasks to finish.
+  void cancelRender();
+
+  /// Holds the background render until resumeRender() is invoked, so
+  /// that the scene can be safely edited in the meantime. Does nothing
+  /// if no background render is running.
+  void pauseRender();
+  void resumeRender();
+
+  /// Copies the tiles finished since the last call into the image.
+  void updateImage(Image&);
+
+  bool isRendering() const
+  {
+    return _rendering;
+  }
+
 private:
   struct VRC
   {
@@ -85,26 +204,154 @@ private:
     vec3f n;
   };
 
+  // Per-thread ray state, merged into the totals after rendering
+  struct alignas(64) Context
+  {
+    Ray pixelRay;
+    uint32_t seed{}; // random state, seeded by the pixel being shot
+    uint64_t numberOfRays{};
+    uint64_t numberOfHits{};
+    uint64_t numberOfShadowRays{};
+    uint64_t numberOfNodeVisits{};
+    // Last occluder of the shadow rays to each light, tested before
+    // the scene BVH is traversed
+    std::vector<SceneBVH::Occluder> occluders;
+    uint64_t numberOfOccluderTests{};
+    uint64_t numberOfOccluderHits{};
+    uint64_t numberOfSamples{}; // taken by supersampling
+    int maxPixelSamples{};
+
+  }; // Context
+
+  // Render-ready primitive of the scene BVH instance of same index,
+  // compiled when a render starts
+  struct PrimitiveInfo
+  {
+    mat3f normalMatrix;
+    Material material;
+    const Shape* shape; // null if the primitive has a mesh
+    const vec3f* vertexNormals;
+    const TriangleMesh::Triangle* triangles;
+
+  }; // PrimitiveInfo
+
+  // Render-ready light, compiled when a render starts
+  struct LightInfo
+  {
+    Light::Type type;
+    Color color;
+    vec3f position;
+    vec3f direction;
+    float cosCutoff; // cosine of the openning angle (spot lights)
+    int decayValue;
+    int decayExponent;
+
+  }; // LightInfo
+
+  // Tile finished by a progressive pass, waiting to be published
+  struct Tile
+  {
+    int x;
+    int y;
+    ImageBuffer data;
+
+  }; // Tile
+
   uint32_t _maxRecursionLevel;
   float _minWeight;
+  int _numberOfThreads{};
+  int _tileSize{32};
+  int _packetSize{1};
+  int _lightSamples{};
+  int _maxSamplingLevel{};
+  float _contrastThreshold{DEFAULT_CONTRAST_THRESHOLD};
   uint64_t _numberOfRays;
   uint64_t _numberOfHits;
+  uint64_t _numberOfShadowRays;
+  uint64_t _numberOfNodeVisits;
+  uint64_t _numberOfOccluderTests;
+  uint64_t _numberOfOccluderHits;
+  uint64_t _numberOfSamples;
+  int _maxPixelSamples;
   Ray _pixelRay;
   VRC _vrc;
+  Reference<SceneBVH> _sceneBVH;
+  Reference<ThreadPool> _threadPool;
+  std::vector<Context> _contexts;
+  std::vector<PrimitiveInfo> _primitives;
+  std::vector<LightInfo> _lights; // directional lights first
+  int _numberOfDirectionalLights;
+  Reference<LightBVH> _lightBVH;
+  vec3f _cameraPosition;
+  Color _ambientLight;
+  Color _backgroundColor;
+  ImageBuffer _buffer;
+  std::vector<int> _objectIds; // of the pixels of the buffer, -1 if none
+  std::vector<uint8_t> _edges; // pixels to supersample
+  std::thread _renderThread;
+  std::atomic<bool> _rendering{};
+  std::atomic<bool> _canceled{};
+  std::atomic<bool> _paused{};
+  int _busyTiles{};
+  std::mutex _gateMutex;
+  std::condition_variable _gateOpened;
+  std::condition_variable _gateIdle;
+  std::mutex _tileMutex;
+  std::vector<Tile> _tiles;
   float _Vh;
   float _Vw;
   float _Ih;
   float _Iw;
 
+  void init();
+  void compile();
   void scan(Image& image);
-  void setPixelRay(float x, float y);
-  Color shoot(float x, float y);
-  bool intersect(const Ray&, Intersection&);
-  Color trace(const Ray& ray, uint32_t level, float weight);
-	Color directLight(const Ray& ray, Intersection& hit, vec3f&, vec3f&, vec3f&);
+  void scanPass(int step, bool refine);
+  void scanTile(Context&,
+    int x0,
+    int y0,
+    int x1,
+    int y1,
+    int step,
+    bool refine);
+  void mergeCounters();
+  void antialiasPass();
+  void antialiasTile(Context&, int x0, int y0, int x1, int y1);
+  bool contrast(const Color&, const Color&) const;
+  bool contrast(const Pixel&, const Pixel&) const;
+  Color supersample(Context&,
+    float x,
+    float y,
+    float size,
+    int level,
+    int& samples);
+  bool enterTile();
+  bool reenterTile();
+  void leaveTile();
+  void publishTile(int x0, int y0, int x1, int y1);
+  void progressiveScan();
+  void printStatistics() const;
+  void setPixelRay(Ray&, float x, float y);
+  Color shoot(Context&, float x, float y, int& id);
+  void shoot(Context&,
+    RayPacket&,
+    const int* xs,
+    const int* ys,
+    Color*,
+    int* ids);
+  void seed(Context&, int x, int y) const;
+  float random(Context&) const;
+  bool intersect(Context&, const Ray&, Intersection&);
+  Color trace(Context&,
+    const Ray& ray,
+    uint32_t level,
+    float weight,
+    int* id = nullptr);
+	Color directLight(Context&, const Ray& ray, Intersection& hit, vec3f&, vec3f&, vec3f&);
+	Color directLight(Context&, int light, const Material&, const vec3f&, const vec3f&, const vec3f&);
 	vec3f reflect(vec3f v, vec3f r);
-	Color shade(const Ray&, Intersection&, int, float);
-  bool shadow(const Ray&);
+	Color shade(Context&, const Ray&, Intersection&, int, float);
+  bool shadow(Context&, const Ray&, int light);
   Color background() const;
 
   vec3f imageToWindow(float x, float y) const
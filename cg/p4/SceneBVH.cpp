@@ -0,0 +1,450 @@
+//[]---------------------------------------------------------------[]
+//|                                                                 |
+//| Copyright (C) 2019 Orthrus Group.                               |
+//|                                                                 |
+//| This software is provided 'as-is', without any express or       |
+//| implied warranty. In no event will the authors be held liable   |
+//| for any damages arising from the use of this software.          |
+//|                                                                 |
+//| Permission is granted to anyone to use this software for any    |
+//| purpose, including commercial applications, and to alter it and |
+//| redistribute it freely, subject to the following restrictions:  |
+//|                                                                 |
+//| 1. The origin of this software must not be misrepresented; you  |
+//| must not claim that you wrote the original software. If you use |
+//| this software in a product, an acknowledgment in the product    |
+//| documentation would be appreciated but is not required.         |
+//|                                                                 |
+//| 2. Altered source versions must be plainly marked as such, and  |
+//| must not be misrepresented as being the original software.      |
+//|                                                                 |
+//| 3. This notice may not be removed or altered from any source    |
+//| distribution.                                                   |
+//|                                                                 |
+//[]---------------------------------------------------------------[]
+//
+// OVERVIEW: SceneBVH.cpp
+// ========
+// Source file for scene BVH.
+//
+// Author(s): Paulo Pagliosa (and your name)
+// Last revision: 18/11/2019
+
+#include "SceneBVH.h"
+#include "SceneObject.h"
+#include <cstring>
+
+namespace cg
+{ // begin namespace cg
+
+void
+SceneBVH::Instance::setTransform()
+{
+  auto t = primitive->transform();
+
+  localToWorld = t->localToWorldMatrix();
+  worldToLocal = t->worldToLocalMatrix();
+  if (shape != nullptr)
+  {
+    bounds = Bounds3f{shape->bounds(), localToWorld};
+    meshVersion = 0;
+  }
+  else
+  {
+    bounds = Bounds3f{bvh->bounds(), localToWorld};
+    meshVersion = bvh->meshVersion();
+  }
+
+  // Pad the world bounds so that rays grazing a face of the mesh,
+  // which hit it in local space, are not culled by rounding errors
+  vec3f e{bounds.maxSize() * 1e-5f};
+
+  bounds = Bounds3f{bounds.min() - e, bounds.max() + e};
+}
+
+void
+SceneBVH::update()
+{
+  PrimitiveArray primitives;
+
+  for (auto it = _scene->getPrimitiveIter(); it != _scene->getPrimitiveEnd(); ++it)
+    if (auto p = dynamic_cast<Primitive*>((Component*)(*it)))
+    {
+      if (!p->sceneObject()->visible)
+        continue;
+      // A shape takes the place of the BVH of the primitive mesh
+      if (auto shape = p->shape())
+        primitives.emplace_back(p, nullptr, shape);
+      else if (auto bvh = p->getBVH())
+      {
+        // A BVH shared by several primitives is refit by the first call
+        bvh->update();
+        primitives.emplace_back(p, bvh, nullptr);
+      }
+    }
+  if (primitives == _primitives)
+    refit();
+  else
+  {
+    _primitives.swap(primitives);
+    build();
+  }
+}
+
+void
+SceneBVH::refit()
+{
+  auto changed = false;
+
+  for (auto& instance : _instances)
+  {
+    const auto& m = instance.primitive->transform()->localToWorldMatrix();
+
+    if (std::memcmp(&m, &instance.localToWorld, sizeof(mat4f)) != 0 ||
+      (instance.bvh != nullptr &&
+      instance.meshVersion != instance.bvh->meshVersion()))
+    {
+      instance.setTransform();
+      changed = true;
+    }
+  }
+  if (!changed)
+    return;
+  // Children are stored after their parents, so a reverse sweep
+  // updates the bounds bottom-up
+  for (auto i = int(_nodes.size()) - 1; i >= 0; --i)
+  {
+    auto& node = _nodes[i];
+
+    node.bounds.setEmpty();
+    if (!node.isLeaf())
+    {
+      node.bounds.inflate(_nodes[i + 1].bounds);
+      node.bounds.inflate(_nodes[node.secondChild].bounds);
+    }
+    else
+      for (int k = node.first, e = k + node.count; k < e; ++k)
+        node.bounds.inflate(_instances[k].bounds);
+  }
+}
+
+void
+SceneBVH::build()
+{
+  auto n = int(_primitives.size());
+
+  _instances.resize(n);
+  _nodes.clear();
+  for (int i = 0; i < n; ++i)
+  {
+    std::tie(_instances[i].primitive,
+      _instances[i].bvh,
+      _instances[i].shape) = _primitives[i];
+    _instances[i].setTransform();
+  }
+  if (n > 0)
+  {
+    _nodes.reserve(2 * n - 1);
+    makeNode(0, n, 0);
+  }
+}
+
+void
+SceneBVH::makeNode(int start, int end, int depth)
+{
+  auto index = int(_nodes.size());
+  auto& node = _nodes.emplace_back();
+  Bounds3f centroidBounds;
+
+  for (int i = start; i < end; ++i)
+  {
+    node.bounds.inflate(_instances[i].bounds);
+    centroidBounds.inflate(_instances[i].bounds.center());
+  }
+  node.axis = node.pad = 0;
+
+  auto dim = maxDim(centroidBounds);
+
+  if (end - start == 1 || depth == BVH_MAX_DEPTH - 1 ||
+    (centroidBounds.size()[dim] == 0 && end - start <= BVH_MAX_LEAF_SIZE))
+  {
+    node.first = start;
+    node.count = uint16_t(end - start);
+    return;
+  }
+
+  auto mid = medianSplit(_instances.data(),
+    start,
+    end,
+    dim,
+    [](const Instance& i) { return i.bounds.center(); });
+
+  node.count = 0;
+  node.axis = uint8_t(dim);
+  makeNode(start, mid, depth + 1);
+
+  auto secondChild = int(_nodes.size());
+
+  makeNode(mid, end, depth + 1);
+  _nodes[index].secondChild = secondChild;
+}
+
+bool
+SceneBVH::intersect(const Node* node,
+  const Ray& ray,
+  Intersection& hit) const
+{
+  // Closest hits are searched from the ray origin on
+  const RayPrecomputed r{ray, 0, math::Limits<float>::inf()};
+  const Node* stack[BVH_MAX_DEPTH];
+  auto top = 0;
+  auto ret = false;
+
+  for (;;)
+  {
+    float tMin, tMax;
+
+    ++hit.nodesVisited;
+    if (node->bounds.intersect(r, tMin, tMax) && tMin <= hit.distance)
+    {
+      if (!node->isLeaf())
+      {
+        auto second = _nodes.data() + node->secondChild;
+
+        if (r.sign[node->axis])
+        {
+          stack[top++] = node + 1;
+          node = second;
+        }
+        else
+        {
+          stack[top++] = second;
+          ++node;
+        }
+        continue;
+      }
+      for (int i = node->first, e = i + node->count; i < e; ++i)
+      {
+        const auto& instance = _instances[i];
+        const auto& m = instance.worldToLocal;
+        auto D = m.transformVector(ray.direction);
+        auto d = math::inverse(D.length());
+
+        if (instance.intersect({m.transform(ray.origin), D}, hit, d))
+        {
+          hit.object = instance.primitive;
+          hit.instance = i;
+          ret = true;
+        }
+      }
+    }
+    if (top == 0)
+      break;
+    node = stack[--top];
+  }
+  return ret;
+}
+
+bool
+SceneBVH::intersect(const Ray& ray, Intersection& hit) const
+{
+  return !_nodes.empty() && intersect(_nodes.data(), ray, hit);
+}
+
+int
+SceneBVH::intersect(const RayPacket& packet, Intersection* hits) const
+//[]---------------------------------------------------[]
+//|  Packet intersection                                |
+//|  @param packet rays and their bounds                |
+//|  @param hits closest hits of the rays (in/out)      |
+//|  @return mask of the rays whose hit was updated     |
+//|                                                     |
+//|  Same scheme as BVH::intersect(const RayPacket&...) |
+//|  The rays entering an instance are transformed to   |
+//|  a local packet traced through the instance BVH.    |
+//[]---------------------------------------------------[]
+{
+  auto mask = (1 << packet.size) - 1;
+
+  if (_nodes.empty() || packet.size == 0)
+    return 0;
+
+  auto ret = 0;
+
+  if (!packet.isCoherent())
+  {
+    for (int k = 0; k < packet.size; ++k)
+      if (intersect(_nodes.data(), packet.rays[k], hits[k]))
+        ret |= 1 << k;
+    return ret;
+  }
+
+  struct Entry
+  {
+    const Node* node;
+    int mask;
+  };
+
+  Entry stack[BVH_MAX_DEPTH];
+  auto top = 0;
+  auto node = _nodes.data();
+  RayPacket local;
+
+  local.size = packet.size;
+  for (;;)
+  {
+    auto first = 0;
+    auto distance = 0.0f;
+
+    while ((mask & (1 << first)) == 0)
+      ++first;
+    ++hits[first].nodesVisited;
+    for (int k = first; k < packet.size; ++k)
+      if ((mask & (1 << k)) != 0)
+        distance = std::max(distance, hits[k].distance);
+    if (!packet.misses(node->bounds, distance))
+    {
+      float tMin[RAY_PACKET_SIZE], tMax[RAY_PACKET_SIZE];
+      auto active = 0;
+      auto count = 0;
+
+      packet.intersect(node->bounds, tMin, tMax);
+      for (int k = first; k < packet.size; ++k)
+      {
+        if ((mask & (1 << k)) != 0 &&
+          tMin[k] <= tMax[k] &&
+          tMax[k] >= 0 && tMin[k] <= hits[k].distance)
+        {
+          active |= 1 << k;
+          ++count;
+        }
+      }
+      if (count > 0 && count < RAY_PACKET_MIN_ACTIVE)
+      {
+        for (int k = first; k < packet.size; ++k)
+          if ((active & (1 << k)) != 0 &&
+            intersect(node, packet.rays[k], hits[k]))
+            ret |= 1 << k;
+      }
+      else if (count > 0)
+      {
+        if (!node->isLeaf())
+        {
+          auto second = _nodes.data() + node->secondChild;
+
+          if (packet.isDirNeg(node->axis))
+          {
+            stack[top++] = {node + 1, active};
+            node = second;
+          }
+          else
+          {
+            stack[top++] = {second, active};
+            ++node;
+          }
+          mask = active;
+          continue;
+        }
+        for (int i = node->first, e = i + node->count; i < e; ++i)
+        {
+          const auto& instance = _instances[i];
+          const auto& m = instance.worldToLocal;
+
+          for (int k = first; k < packet.size; ++k)
+          {
+            if ((active & (1 << k)) == 0)
+              continue;
+
+            const auto& ray = packet.rays[k];
+            auto D = m.transformVector(ray.direction);
+
+            local.rays[k] = {m.transform(ray.origin), D};
+            local.d[k] = math::inverse(D.length());
+          }
+
+          auto h = 0;
+
+          // Shapes are intersected ray by ray
+          if (instance.shape != nullptr)
+          {
+            for (int k = first; k < packet.size; ++k)
+              if ((active & (1 << k)) != 0 &&
+                instance.shape->intersect(local.rays[k], hits[k], local.d[k]))
+                h |= 1 << k;
+          }
+          else
+          {
+            local.init(active);
+            h = instance.bvh->intersect(local, active, hits);
+          }
+
+          for (int k = first; k < packet.size; ++k)
+            if ((h & (1 << k)) != 0)
+            {
+              hits[k].object = instance.primitive;
+              hits[k].instance = i;
+            }
+          ret |= h;
+        }
+      }
+    }
+    if (top == 0)
+      break;
+    --top;
+    node = stack[top].node;
+    mask = stack[top].mask;
+  }
+  return ret;
+}
+
+bool
+SceneBVH::occluded(const Ray& ray, Occluder& occluder) const
+{
+  if (_nodes.empty())
+    return false;
+
+  const RayPrecomputed r{ray};
+  const Node* stack[BVH_MAX_DEPTH];
+  auto top = 0;
+  auto node = _nodes.data();
+
+  for (;;)
+  {
+    float tMin, tMax;
+
+    if (node->bounds.intersect(r, tMin, tMax))
+    {
+      if (!node->isLeaf())
+      {
+        stack[top++] = _nodes.data() + node->secondChild;
+        ++node;
+        continue;
+      }
+      for (int i = node->first, e = i + node->count; i < e; ++i)
+      {
+        const auto& instance = _instances[i];
+        int triangle;
+
+        if (instance.occluded(instance.localRay(ray), triangle))
+        {
+          occluder = {i, triangle};
+          return true;
+        }
+      }
+    }
+    if (top == 0)
+      break;
+    node = stack[--top];
+  }
+  return false;
+}
+
+bool
+SceneBVH::occludedBy(const Occluder& occluder, const Ray& ray) const
+{
+  const auto& instance = _instances[occluder.instance];
+
+  return instance.occludedBy(occluder.triangle, instance.localRay(ray));
+}
+
+} // end namespace cg
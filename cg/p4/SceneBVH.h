@@ -0,0 +1,188 @@
+//[]---------------------------------------------------------------[]
+//|                                                                 |
+//| Copyright (C) 2019 Orthrus Group.                               |
+//|                                                                 |
+//| This software is provided 'as-is', without any express or       |
+//| implied warranty. In no event will the authors be held liable   |
+//| for any damages arising from the use of this software.          |
+//|                                                                 |
+//| Permission is granted to anyone to use this software for any    |
+//| purpose, including commercial applications, and to alter it and |
+//| redistribute it freely, subject to the following restrictions:  |
+//|                                                                 |
+//| 1. The origin of this software must not be misrepresented; you  |
+//| must not claim that you wrote the original software. If you use |
+//| this software in a product, an acknowledgment in the product    |
+//| documentation would be appreciated but is not required.         |
+//|                                                                 |
+//| 2. Altered source versions must be plainly marked as such, and  |
+//| must not be misrepresented as being the original software.      |
+//|                                                                 |
+//| 3. This notice may not be removed or altered from any source    |
+//| distribution.                                                   |
+//|                                                                 |
+//[]---------------------------------------------------------------[]
+//
+// OVERVIEW: SceneBVH.h
+// ========
+// Class definition for scene BVH.
+//
+// Author(s): Paulo Pagliosa (and your name)
+// Last revision: 18/11/2019
+
+#ifndef __SceneBVH_h
+#define __SceneBVH_h
+
+#include "BVHNode.h"
+#include "Scene.h"
+#include <tuple>
+
+namespace cg
+{ // begin namespace cg
+
+
+/////////////////////////////////////////////////////////////////////
+//
+// SceneBVH: top-level BVH over the primitives of a scene
+// ========
+// Each leaf references instances of the per-mesh BVHs shared among
+// primitives, or of the analytic shapes of primitives, whose bounds
+// are transformed to world space.
+//
+class SceneBVH: public SharedObject
+{
+public:
+  /// Primitive found to block a shadow ray: the index of its instance
+  /// and of the triangle hit (-1 if the primitive has a shape).
+  struct Occluder
+  {
+    int instance{-1};
+    int triangle{-1};
+
+  }; // Occluder
+
+  SceneBVH(Scene& scene):
+    _scene{&scene}
+  {
+    // do nothing
+  }
+
+  auto scene() const
+  {
+    return _scene;
+  }
+
+  auto size() const
+  {
+    return int(_instances.size());
+  }
+
+  /// Returns the primitive of the i-th instance, as referenced by
+  /// Intersection::instance. Instances are reordered by update().
+  auto primitive(int i) const
+  {
+    return _instances[i].primitive;
+  }
+
+  Bounds3f bounds() const
+  {
+    return _nodes.empty() ? Bounds3f{} : _nodes[0].bounds;
+  }
+
+  /// Rebuilds the tree if the set of visible primitives has changed,
+  /// or refits it if any of their transforms or meshes has changed.
+  /// The BVHs of changed meshes are updated as well. Must be called
+  /// before tracing rays whenever the scene may have changed.
+  void update();
+
+  bool intersect(const Ray& ray, Intersection& hit) const;
+
+  bool occluded(const Ray& ray) const
+  {
+    Occluder occluder;
+
+    return occluded(ray, occluder);
+  }
+
+  /// Same as occluded(ray), but also returns the primitive found to
+  /// block the ray. The occluder is left untouched if there is none.
+  bool occluded(const Ray& ray, Occluder& occluder) const;
+
+  /// Returns true if the occluder blocks the ray.
+  bool occludedBy(const Occluder& occluder, const Ray& ray) const;
+
+  /// Intersects the rays of a packet. Returns the mask of the rays
+  /// whose hit was updated.
+  int intersect(const RayPacket& packet, Intersection* hits) const;
+
+private:
+  struct Instance
+  {
+    Primitive* primitive;
+    BVH* bvh; // null if the primitive has a shape
+    Shape* shape;
+    mat4f localToWorld;
+    mat4f worldToLocal;
+    Bounds3f bounds;
+    uint32_t meshVersion; // of bvh when bounds were computed
+
+    void setTransform();
+
+    bool intersect(const Ray& ray, Intersection& hit, float d) const
+    {
+      return shape != nullptr ?
+        shape->intersect(ray, hit, d) :
+        bvh->intersect(ray, hit, d);
+    }
+
+    // Shadow rays keep their extent in local space
+    Ray localRay(const Ray& ray) const
+    {
+      auto D = worldToLocal.transformVector(ray.direction);
+      auto s = D.length();
+
+      return {worldToLocal.transform(ray.origin),
+        D,
+        ray.tMin * s,
+        ray.tMax * s};
+    }
+
+    bool occluded(const Ray& ray, int& triangle) const
+    {
+      if (shape != nullptr)
+      {
+        triangle = -1;
+        return shape->occluded(ray);
+      }
+      return (triangle = bvh->occluder(ray)) >= 0;
+    }
+
+    bool occludedBy(int triangle, const Ray& ray) const
+    {
+      return shape != nullptr ?
+        shape->occluded(ray) :
+        bvh->occludedBy(triangle, ray);
+    }
+
+  }; // Instance
+
+  // Leaves reference ranges of _instances
+  using Node = BVHNode;
+
+  using PrimitiveArray = std::vector<std::tuple<Primitive*, BVH*, Shape*>>;
+
+  Reference<Scene> _scene;
+  PrimitiveArray _primitives;
+  std::vector<Instance> _instances;
+  std::vector<Node> _nodes;
+
+  void build();
+  void makeNode(int start, int end, int depth);
+  void refit();
+  bool intersect(const Node* node, const Ray& ray, Intersection& hit) const;
+
+}; // SceneBVH
+
+} // end namespace cg
+
+#endif // __SceneBVH_h
@@ -0,0 +1,156 @@
+//[]---------------------------------------------------------------[]
+//|                                                                 |
+//| Copyright (C) 2019 Orthrus Group.                               |
+//|                                                                 |
+//| This software is provided 'as-is', without any express or       |
+//| implied warranty. In no event will the authors be held liable   |
+//| for any damages arising from the use of this software.          |
+//|                                                                 |
+//| Permission is granted to anyone to use this software for any    |
+//| purpose, including commercial applications, and to alter it and |
+//| redistribute it freely, subject to the following restrictions:  |
+//|                                                                 |
+//| 1. The origin of this software must not be misrepresented; you  |
+//| must not claim that you wrote the original software. If you use |
+//| this software in a product, an acknowledgment in the product    |
+//| documentation would be appreciated but is not required.         |
+//|                                                                 |
+//| 2. Altered source versions must be plainly marked as such, and  |
+//| must not be misrepresented as being the original software.      |
+//|                                                                 |
+//| 3. This notice may not be removed or altered from any source    |
+//| distribution.                                                   |
+//|                                                                 |
+//[]---------------------------------------------------------------[]
+//
+// OVERVIEW: Shape.cpp
+// ========
+// Source file for analytic shape.
+//
+// Author(s): Paulo Pagliosa (and your name)
+// Last revision: 18/11/2019
+
+#include "Shape.h"
+#include <cmath>
+
+namespace cg
+{ // begin namespace cg
+
+
+/////////////////////////////////////////////////////////////////////
+//
+// Shape implementation
+// =====
+bool
+Shape::intersect(const Ray& ray, Intersection& hit, float d) const
+{
+  float t0, t1;
+
+  if (!interval(ray, t0, t1))
+    return false;
+
+  // The exit point is hit by rays starting inside the shape
+  auto t = t0 >= 0 ? t0 : t1;
+
+  if (t < 0)
+    return false;
+
+  auto dist = t * d;
+
+  if (dist > hit.distance)
+    return false;
+  hit.triangleIndex = -1;
+  hit.distance = dist;
+  hit.p = ray(t);
+  return true;
+}
+
+bool
+Shape::occluded(const Ray& ray) const
+{
+  float t0, t1;
+
+  if (!interval(ray, t0, t1))
+    return false;
+  return (t0 >= ray.tMin && t0 <= ray.tMax) ||
+    (t1 >= ray.tMin && t1 <= ray.tMax);
+}
+
+
+/////////////////////////////////////////////////////////////////////
+//
+// Sphere implementation
+// ======
+Bounds3f
+Sphere::bounds() const
+{
+  return Bounds3f{{-1, -1, -1}, {+1, +1, +1}};
+}
+
+vec3f
+Sphere::normal(const Intersection& hit) const
+{
+  return hit.p.versor();
+}
+
+bool
+Sphere::interval(const Ray& ray, float& t0, float& t1) const
+{
+  // Roots of t^2 + 2bt + c, with a unit ray direction
+  auto b = ray.origin.dot(ray.direction);
+  auto c = ray.origin.dot(ray.origin) - 1;
+  auto delta = b * b - c;
+
+  if (delta < 0)
+    return false;
+
+  // The root of larger magnitude is computed first, so that the
+  // other one does not suffer from cancellation
+  auto q = -b - std::copysign(std::sqrt(delta), b);
+
+  if (q == 0)
+    t0 = t1 = 0;
+  else
+  {
+    t0 = q;
+    t1 = c / q;
+    if (t0 > t1)
+      std::swap(t0, t1);
+  }
+  return true;
+}
+
+
+/////////////////////////////////////////////////////////////////////
+//
+// Box implementation
+// ===
+Bounds3f
+Box::bounds() const
+{
+  return Bounds3f{{-1, -1, -1}, {+1, +1, +1}};
+}
+
+vec3f
+Box::normal(const Intersection& hit) const
+{
+  // Normal of the face of the point, the one of the largest coordinate
+  const auto& p = hit.p;
+  auto i = std::abs(p.x) > std::abs(p.y) ?
+    (std::abs(p.x) > std::abs(p.z) ? 0 : 2) :
+    (std::abs(p.y) > std::abs(p.z) ? 1 : 2);
+  vec3f N{0, 0, 0};
+
+  N[i] = p[i] < 0 ? -1.0f : 1.0f;
+  return N;
+}
+
+bool
+Box::interval(const Ray& ray, float& t0, float& t1) const
+{
+  const auto inf = math::Limits<float>::inf();
+
+  return bounds().intersect(RayPrecomputed{ray, -inf, inf}, t0, t1);
+}
+
+} // end namespace cg
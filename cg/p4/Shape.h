@@ -0,0 +1,115 @@
+//[]---------------------------------------------------------------[]
+//|                                                                 |
+//| Copyright (C) 2019 Orthrus Group.                               |
+//|                                                                 |
+//| This software is provided 'as-is', without any express or       |
+//| implied warranty. In no event will the authors be held liable   |
+//| for any damages arising from the use of this software.          |
+//|                                                                 |
+//| Permission is granted to anyone to use this software for any    |
+//| purpose, including commercial applications, and to alter it and |
+//| redistribute it freely, subject to the following restrictions:  |
+//|                                                                 |
+//| 1. The origin of this software must not be misrepresented; you  |
+//| must not claim that you wrote the original software. If you use |
+//| this software in a product, an acknowledgment in the product    |
+//| documentation would be appreciated but is not required.         |
+//|                                                                 |
+//| 2. Altered source versions must be plainly marked as such, and  |
+//| must not be misrepresented as being the original software.      |
+//|                                                                 |
+//| 3. This notice may not be removed or altered from any source    |
+//| distribution.                                                   |
+//|                                                                 |
+//[]---------------------------------------------------------------[]
+//
+// OVERVIEW: Shape.h
+// ========
+// Class definition for analytic shape.
+//
+// Author(s): Paulo Pagliosa (and your name)
+// Last revision: 18/11/2019
+
+#ifndef __Shape_h
+#define __Shape_h
+
+#include "core/SharedObject.h"
+#include "geometry/Bounds3.h"
+#include "Intersection.h"
+
+namespace cg
+{ // begin namespace cg
+
+
+/////////////////////////////////////////////////////////////////////
+//
+// Shape: analytic shape class
+// =====
+// Geometry of a primitive intersected exactly by the ray tracer, in
+// place of the BVH of its mesh (which is still drawn by the GL
+// preview). A shape is defined in the local space of its primitive.
+// As in BVH::intersect(), rays have unit direction and d is the world
+// length of a unit of ray parameter. A hit stores the local position
+// of the intersection point in Intersection::p and sets the triangle
+// index to -1.
+//
+class Shape: public SharedObject
+{
+public:
+  virtual Bounds3f bounds() const = 0;
+
+  /// Returns true if the ray hits the shape closer than hit.distance.
+  bool intersect(const Ray& ray, Intersection& hit, float d) const;
+
+  /// Returns true if the ray hits the shape within [ray.tMin, ray.tMax].
+  bool occluded(const Ray& ray) const;
+
+  /// Returns the local normal at the intersection point of hit.
+  virtual vec3f normal(const Intersection& hit) const = 0;
+
+protected:
+  /// Computes the parameters of the points where the ray line enters
+  /// and leaves the shape. Returns false if the line misses it.
+  virtual bool interval(const Ray& ray, float& t0, float& t1) const = 0;
+
+}; // Shape
+
+
+/////////////////////////////////////////////////////////////////////
+//
+// Sphere: unit sphere centered at the origin class
+// ======
+// Same sphere as the one of MeshSweeper::makeSphere().
+//
+class Sphere final: public Shape
+{
+public:
+  Bounds3f bounds() const override;
+  vec3f normal(const Intersection& hit) const override;
+
+private:
+  bool interval(const Ray& ray, float& t0, float& t1) const override;
+
+}; // Sphere
+
+
+/////////////////////////////////////////////////////////////////////
+//
+// Box: box [-1, 1]^3 class
+// ===
+// Same box as the one of MeshSweeper::makeBox().
+//
+class Box final: public Shape
+{
+public:
+  Bounds3f bounds() const override;
+  vec3f normal(const Intersection& hit) const override;
+
+private:
+  bool interval(const Ray& ray, float& t0, float& t1) const override;
+
+}; // Box
+
+} // end namespace cg
+
+#endif // __Shape_h
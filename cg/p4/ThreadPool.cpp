@@ -0,0 +1,174 @@
+//[]---------------------------------------------------------------[]
+//|                                                                 |
+//| Copyright (C) 2019 Orthrus Group.                               |
+//|                                                                 |
+//| This software is provided 'as-is', without any express or       |
+//| implied warranty. In no event will the authors be held liable   |
+//| for any damages arising from the use of this software.          |
+//|                                                                 |
+//| Permission is granted to anyone to use this software for any    |
+//| purpose, including commercial applications, and to alter it and |
+//| redistribute it freely, subject to the following restrictions:  |
+//|                                                                 |
+//| 1. The origin of this software must not be misrepresented; you  |
+//| must not claim that you wrote the original software. If you use |
+//| this software in a product, an acknowledgment in the product    |
+//| documentation would be appreciated but is not required.         |
+//|                                                                 |
+//| 2. Altered source versions must be plainly marked as such, and  |
+//| must not be misrepresented as being the original software.      |
+//|                                                                 |
+//| 3. This notice may not be removed or altered from any source    |
+//| distribution.                                                   |
+//|                                                                 |
+//[]---------------------------------------------------------------[]
+//
+// OVERVIEW: ThreadPool.cpp
+// ========
+// Source file for work-stealing thread pool.
+//
+// Author(s): Paulo Pagliosa (and your name)
+// Last revision: 18/11/2019
+
+#include "ThreadPool.h"
+#include <algorithm>
+
+namespace cg
+{ // begin namespace cg
+
+
+/////////////////////////////////////////////////////////////////////
+//
+// ThreadPool implementation
+// ==========
+int
+ThreadPool::defaultSize()
+{
+  return std::max(int(std::thread::hardware_concurrency()), 1);
+}
+
+ThreadPool::ThreadPool(int n):
+  _queues(n > 0 ? n : defaultSize())
+{
+  n = int(_queues.size());
+  _workers.reserve(n);
+  for (int i = 0; i < n; ++i)
+    _workers.emplace_back(&ThreadPool::run, this, i);
+}
+
+ThreadPool::~ThreadPool()
+{
+  {
+    std::lock_guard<std::mutex> lock{_mutex};
+    _stop = true;
+  }
+  _hasWork.notify_all();
+  for (auto& worker : _workers)
+    worker.join();
+}
+
+void
+ThreadPool::submit(Task task)
+{
+  auto& queue = _queues[_next];
+
+  _next = (_next + 1) % size();
+  // The task is counted before it can be popped, so that _pending
+  // never drops to zero while it is queued or running
+  {
+    std::lock_guard<std::mutex> lock{_mutex};
+    ++_queued;
+    ++_pending;
+  }
+  {
+    std::lock_guard<std::mutex> lock{queue.mutex};
+    queue.tasks.push_back(std::move(task));
+  }
+  _hasWork.notify_one();
+}
+
+void
+ThreadPool::submit(int worker, Task task)
+{
+  auto& queue = _queues[worker];
+
+  // Counted before pushed, as in submit(task): if another worker stole
+  // and finished the task first, wait() could return while the
+  // submitting task is still running
+  {
+    std::lock_guard<std::mutex> lock{_mutex};
+    ++_queued;
+    ++_pending;
+  }
+  {
+    std::lock_guard<std::mutex> lock{queue.mutex};
+    queue.tasks.push_front(std::move(task));
+  }
+  _hasWork.notify_one();
+}
+
+void
+ThreadPool::wait()
+{
+  std::unique_lock<std::mutex> lock{_mutex};
+  _done.wait(lock, [this]() { return _pending == 0; });
+}
+
+bool
+ThreadPool::pop(int worker, Task& task)
+{
+  auto n = size();
+
+  for (int i = 0; i < n; ++i)
+  {
+    // Own queue first (front), then steal from the others (back)
+    auto& queue = _queues[(worker + i) % n];
+    std::lock_guard<std::mutex> lock{queue.mutex};
+
+    if (queue.tasks.empty())
+      continue;
+    if (i == 0)
+    {
+      task = std::move(queue.tasks.front());
+      queue.tasks.pop_front();
+    }
+    else
+    {
+      task = std::move(queue.tasks.back());
+      queue.tasks.pop_back();
+    }
+    return true;
+  }
+  return false;
+}
+
+void
+ThreadPool::run(int worker)
+{
+  for (Task task;;)
+  {
+    if (pop(worker, task))
+    {
+      {
+        std::lock_guard<std::mutex> lock{_mutex};
+        --_queued;
+      }
+      task(worker);
+      task = nullptr;
+
+      std::lock_guard<std::mutex> lock{_mutex};
+
+      if (--_pending == 0)
+        _done.notify_all();
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock{_mutex};
+
+    _hasWork.wait(lock, [this]() { return _stop || _queued > 0; });
+    if (_stop)
+      return;
+  }
+}
+
+} // end namespace cg
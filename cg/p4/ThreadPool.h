@@ -0,0 +1,111 @@
+//[]---------------------------------------------------------------[]
+//|                                                                 |
+//| Copyright (C) 2019 Orthrus Group.                               |
+//|                                                                 |
+//| This software is provided 'as-is', without any express or       |
+//| implied warranty. In no event will the authors be held liable   |
+//| for any damages arising from the use of this software.          |
+//|                                                                 |
+//| Permission is granted to anyone to use this software for any    |
+//| purpose, including commercial applications, and to alter it and |
+//| redistribute it freely, subject to the following restrictions:  |
+//|                                                                 |
+//| 1. The origin of this software must not be misrepresented; you  |
+//| must not claim that you wrote the original software. If you use |
+//| this software in a product, an acknowledgment in the product    |
+//| documentation would be appreciated but is not required.         |
+//|                                                                 |
+//| 2. Altered source versions must be plainly marked as such, and  |
+//| must not be misrepresented as being the original software.      |
+//|                                                                 |
+//| 3. This notice may not be removed or altered from any source    |
+//| distribution.                                                   |
+//|                                                                 |
+//[]---------------------------------------------------------------[]
+//
+// OVERVIEW: ThreadPool.h
+// ========
+// Class definition for work-stealing thread pool.
+//
+// Author(s): Paulo Pagliosa (and your name)
+// Last revision: 18/11/2019
+
+#ifndef __ThreadPool_h
+#define __ThreadPool_h
+
+#include "core/SharedObject.h"
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace cg
+{ // begin namespace cg
+
+
+/////////////////////////////////////////////////////////////////////
+//
+// ThreadPool: work-stealing thread pool class
+// ==========
+// Every worker owns a task queue. Submitted tasks are dealt to the
+// queues round-robin; a worker pops tasks from the front of its own
+// queue and, when it runs dry, steals from the back of the others.
+//
+class ThreadPool: public SharedObject
+{
+public:
+  /// A task receives the index of the worker running it.
+  using Task = std::function<void(int)>;
+
+  /// Constructs a pool with n workers (one per core if n <= 0).
+  ThreadPool(int n = 0);
+
+  ~ThreadPool() override;
+
+  auto size() const
+  {
+    return int(_queues.size());
+  }
+
+  /// Queues a task. Tasks must be submitted (and waited for) from a
+  /// single thread.
+  void submit(Task task);
+
+  /// Queues a task from within a task running on worker. The task is
+  /// put at the front of the worker queue, so the worker runs it next
+  /// unless another worker steals it first. wait() also waits for it.
+  void submit(int worker, Task task);
+
+  /// Blocks until every submitted task has finished.
+  void wait();
+
+  static int defaultSize();
+
+private:
+  struct Queue
+  {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+
+  }; // Queue
+
+  std::vector<std::thread> _workers;
+  std::vector<Queue> _queues;
+  std::mutex _mutex;
+  std::condition_variable _hasWork;
+  std::condition_variable _done;
+  int _queued{}; // tasks waiting in the queues
+  int _pending{}; // tasks queued or running
+  int _next{};
+  bool _stop{};
+
+  bool pop(int worker, Task& task);
+  void run(int worker);
+
+}; // ThreadPool
+
+} // end namespace cg
+
+#endif // __ThreadPool_h
@@ -0,0 +1,87 @@
+//[]---------------------------------------------------------------[]
+//|                                                                 |
+//| Copyright (C) 2019 Orthrus Group.                               |
+//|                                                                 |
+//| This software is provided 'as-is', without any express or       |
+//| implied warranty. In no event will the authors be held liable   |
+//| for any damages arising from the use of this software.          |
+//|                                                                 |
+//| Permission is granted to anyone to use this software for any    |
+//| purpose, including commercial applications, and to alter it and |
+//| redistribute it freely, subject to the following restrictions:  |
+//|                                                                 |
+//| 1. The origin of this software must not be misrepresented; you  |
+//| must not claim that you wrote the original software. If you use |
+//| this software in a product, an acknowledgment in the product    |
+//| documentation would be appreciated but is not required.         |
+//|                                                                 |
+//| 2. Altered source versions must be plainly marked as such, and  |
+//| must not be misrepresented as being the original software.      |
+//|                                                                 |
+//| 3. This notice may not be removed or altered from any source    |
+//| distribution.                                                   |
+//|                                                                 |
+//[]---------------------------------------------------------------[]
+//
+// OVERVIEW: ThreadPoolStress.cpp
+// ========
+// Stress check of nested ThreadPool::submit(worker, task) and wait().
+// Not part of the p4 project; build and run it from cg/p4 with, e.g.,
+//
+//   g++ -std=c++17 -O2 -pthread -I../common/include -I.
+//     tests/ThreadPoolStress.cpp ThreadPool.cpp -o pool_stress
+//
+// Author(s): Paulo Pagliosa (and your name)
+// Last revision: 18/11/2019
+
+#include "ThreadPool.h"
+#include <atomic>
+#include <cstdio>
+
+using namespace cg;
+
+#define STRESS_ROUNDS 20000
+#define STRESS_DEPTH 6 // of the binary tree of nested tasks
+#define STRESS_WORKERS 8 // more than the cores, to interleave them
+
+static std::atomic<int> finished;
+
+static void
+spawn(ThreadPool& pool, int worker, int depth)
+{
+  // Children are submitted before the parent finishes its own work,
+  // the pattern of the parallel BVH build
+  if (depth > 0)
+    for (int i = 0; i < 2; ++i)
+      pool.submit(worker, [&pool, depth](int w)
+      {
+        spawn(pool, w, depth - 1);
+      });
+  for (volatile int spin = 0; spin < 200; ++spin)
+    ;
+  ++finished;
+}
+
+int
+main()
+{
+  ThreadPool pool{STRESS_WORKERS};
+  const auto expected = (1 << (STRESS_DEPTH + 1)) - 1;
+  auto failures = 0;
+
+  for (int r = 0; r < STRESS_ROUNDS; ++r)
+  {
+    finished = 0;
+    pool.submit([&pool](int w) { spawn(pool, w, STRESS_DEPTH); });
+    pool.wait();
+    // Every task must have finished when wait() returns
+    if (finished != expected)
+      ++failures;
+  }
+  printf("%d workers, %d rounds of %d nested tasks: %d early wait() returns\n",
+    pool.size(),
+    STRESS_ROUNDS,
+    expected,
+    failures);
+  return failures != 0;
+}